@@ -16,12 +16,20 @@
 
 #include <assert.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <tls.h>
 #include <unistd.h>
 
@@ -32,17 +40,85 @@
 enum { BufferCap = 8192 + 512 };
 
 static bool verbose;
-static struct tls *client;
 
+// Output is queued and written as the socket allows.
+enum { QueueCap = 4 * BufferCap };
+
+// Each network has its own connection and options. Handling applies to
+// the current network, net.
+static struct Network {
+	const char *host;
+	const char *port;
+	const char *nick;
+	const char *cert;
+	const char *priv;
+	const char *join;
+	bool invite;
+	struct tls *client;
+	int sock;
+	short want;
+	short wantRead;
+	struct {
+		char buf[QueueCap];
+		size_t head;
+		size_t len;
+	} queue;
+	char buf[BufferCap];
+	size_t len;
+} *nets;
+static size_t netsLen;
+static struct Network *net;
+
+static void clientClose(void) {
+	tls_close(net->client);
+	tls_free(net->client);
+	net->client = NULL;
+	close(net->sock);
+	net->sock = -1;
+	net->queue.head = 0;
+	net->queue.len = 0;
+}
+
+// A network whose queue fills is closed, leaving the others running.
 static void clientWrite(const char *ptr, size_t len) {
+	if (net->sock < 0) return;
 	if (verbose) printf("%.*s", (int)len, ptr);
+	if (len > QueueCap - net->queue.len) {
+		warnx("%s: output queue full", net->host);
+		clientClose();
+		return;
+	}
 	while (len) {
-		ssize_t ret = tls_write(client, ptr, len);
-		if (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT) continue;
-		if (ret < 0) errx(1, "tls_write: %s", tls_error(client));
-		ptr += ret;
-		len -= ret;
+		size_t tail = (net->queue.head + net->queue.len) % QueueCap;
+		size_t n = QueueCap - tail;
+		if (n > len) n = len;
+		memcpy(&net->queue.buf[tail], ptr, n);
+		net->queue.len += n;
+		ptr += n;
+		len -= n;
+	}
+}
+
+// Returns the poll event needed to continue writing, or 0 once the queue
+// is empty.
+static short clientFlush(void) {
+	while (net->sock >= 0 && net->queue.len) {
+		size_t n = QueueCap - net->queue.head;
+		if (n > net->queue.len) n = net->queue.len;
+		ssize_t ret = tls_write(
+			net->client, &net->queue.buf[net->queue.head], n
+		);
+		if (ret == TLS_WANT_POLLIN) return POLLIN;
+		if (ret == TLS_WANT_POLLOUT) return POLLOUT;
+		if (ret < 0) {
+			warnx("%s: tls_write: %s", net->host, tls_error(net->client));
+			clientClose();
+			break;
+		}
+		net->queue.head = (net->queue.head + ret) % QueueCap;
+		net->queue.len -= ret;
 	}
+	return 0;
 }
 
 static void format(const char *format, ...) {
@@ -55,41 +131,357 @@ static void format(const char *format, ...) {
 	clientWrite(buf, len);
 }
 
-static bool invite;
-static const char *join;
-
-enum { Cap = 1024 };
-static struct Message {
+struct Message {
 	char *id;
 	char *nick;
 	char *chan;
 	char *mesg;
-} msgs[Cap];
+};
+
+// History entries pack their strings into fixed-size text, allocated once
+// for the whole history, which all networks share. Only the start of a
+// message is kept, enough to quote it.
+enum { TextCap = 160, QuoteLen = 50 };
+static struct Entry {
+	uint32_t hash;
+	uint16_t net;
+	uint8_t nick, chan, mesg;
+	char text[TextCap];
+} *history;
+static size_t historyCap = 1024;
+static size_t historyLen;
 static size_t m;
 
+// The index maps message IDs to history slots by linear probing. Slots
+// are stored plus one so that zero is empty.
+static uint32_t *ids;
+static size_t idsMask;
+
+static uint32_t hash(const char *str) {
+	uint32_t h = 2166136261 ^ (uint32_t)(net - nets);
+	for (; *str; ++str) {
+		h = (h ^ (uint8_t)*str) * 16777619;
+	}
+	return h;
+}
+
+static void historyAlloc(void) {
+	history = calloc(historyCap, sizeof(*history));
+	if (!history) err(1, "calloc");
+	size_t size = 1;
+	while (size < 2 * historyCap) size *= 2;
+	ids = calloc(size, sizeof(*ids));
+	if (!ids) err(1, "calloc");
+	idsMask = size - 1;
+}
+
+static void idsRemove(size_t slot) {
+	size_t i = history[slot].hash & idsMask;
+	while (ids[i] != slot + 1) i = (i + 1) & idsMask;
+	// Shift back later entries which would no longer be reachable.
+	for (size_t j = i;;) {
+		j = (j + 1) & idsMask;
+		if (!ids[j]) break;
+		size_t k = history[ids[j] - 1].hash & idsMask;
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+		ids[i] = ids[j];
+		i = j;
+	}
+	ids[i] = 0;
+}
+
 static void push(struct Message msg) {
-	struct Message *dst = &msgs[m++ % Cap];
-	free(dst->id);
-	free(dst->nick);
-	free(dst->chan);
-	free(dst->mesg);
-	dst->id = strdup(msg.id);
-	dst->nick = strdup(msg.nick);
-	dst->chan = strdup(msg.chan);
-	if (!dst->id || !dst->nick || !dst->chan) err(1, "strdup");
-	dst->mesg = NULL;
+	size_t idLen = strlen(msg.id);
+	size_t nickLen = strlen(msg.nick);
+	size_t chanLen = strlen(msg.chan);
+	size_t len = idLen + 1 + nickLen + 1 + chanLen + 1;
+	if (len + 1 > TextCap) return;
+	// Entries without room to quote their message are not kept.
+	if (msg.mesg && len + QuoteLen + 4 > TextCap) return;
+
+	size_t slot = m++ % historyCap;
+	struct Entry *dst = &history[slot];
+	if (historyLen == historyCap) {
+		idsRemove(slot);
+	} else {
+		historyLen++;
+	}
+
+	dst->net = net - nets;
+	dst->nick = idLen + 1;
+	dst->chan = dst->nick + nickLen + 1;
+	dst->mesg = 0;
+	memcpy(dst->text, msg.id, idLen + 1);
+	memcpy(&dst->text[dst->nick], msg.nick, nickLen + 1);
+	memcpy(&dst->text[dst->chan], msg.chan, chanLen + 1);
 	if (msg.mesg) {
-		dst->mesg = strdup(msg.mesg);
-		if (!dst->mesg) err(1, "strdup");
+		dst->mesg = len;
+		snprintf(
+			&dst->text[len], TextCap - len, "%.*s", QuoteLen + 1, msg.mesg
+		);
 	}
+
+	dst->hash = hash(msg.id);
+	size_t i = dst->hash & idsMask;
+	while (ids[i]) i = (i + 1) & idsMask;
+	ids[i] = slot + 1;
 }
 
-static struct Message *find(const char *id) {
-	for (size_t i = 0; i < Cap; ++i) {
-		if (!msgs[i].id) return NULL;
-		if (!strcmp(msgs[i].id, id)) return &msgs[i];
+static struct Message find(const char *id) {
+	uint32_t h = hash(id);
+	for (size_t i = h & idsMask; ids[i]; i = (i + 1) & idsMask) {
+		struct Entry *entry = &history[ids[i] - 1];
+		if (entry->hash != h || entry->net != net - nets) continue;
+		if (strcmp(entry->text, id)) continue;
+		return (struct Message) {
+			.id = entry->text,
+			.nick = &entry->text[entry->nick],
+			.chan = &entry->text[entry->chan],
+			.mesg = (entry->mesg ? &entry->text[entry->mesg] : NULL),
+		};
+	}
+	return (struct Message) { .id = NULL };
+}
+
+static long now(void) {
+	struct timespec ts;
+	int error = clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (error) err(1, "clock_gettime");
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Timers are kept in a wheel of slots, each a list of the timers due in
+// one tick. Timers further out than the wheel wait for later turns.
+enum { Tick = 250, WheelLen = 256 };
+struct Timer {
+	struct Timer *next;
+	struct Timer **prev;
+	long when;
+	void (*fire)(struct Timer *);
+};
+static struct Timer *wheel[WheelLen];
+static long wheelTime;
+static size_t timers;
+
+static void timerCancel(struct Timer *timer) {
+	if (!timer->prev) return;
+	*timer->prev = timer->next;
+	if (timer->next) timer->next->prev = timer->prev;
+	timer->prev = NULL;
+	timers--;
+}
+
+static void timerSet(struct Timer *timer, long when) {
+	timerCancel(timer);
+	timer->when = when;
+	if (when < wheelTime) when = wheelTime;
+	struct Timer **slot = &wheel[when / Tick % WheelLen];
+	timer->next = *slot;
+	timer->prev = slot;
+	if (*slot) (*slot)->prev = &timer->next;
+	*slot = timer;
+	timers++;
+}
+
+// Each slot is taken from the wheel before the wheel moves on and its
+// timers fire, so timers set while firing land in a later slot.
+static void wheelRun(long time) {
+	while (timers && wheelTime + Tick <= time) {
+		struct Timer **slot = &wheel[wheelTime / Tick % WheelLen];
+		struct Timer *list = *slot;
+		*slot = NULL;
+		if (list) list->prev = &list;
+		wheelTime += Tick;
+		for (struct Timer *timer; (timer = list);) {
+			timerCancel(timer);
+			if (timer->when >= wheelTime) {
+				timerSet(timer, timer->when);
+			} else {
+				timer->fire(timer);
+			}
+		}
+	}
+	if (!timers) wheelTime = time / Tick * Tick;
+}
+
+// Milliseconds until the next tick, or -1 without timers.
+static int wheelWait(void) {
+	if (!timers) return -1;
+	long wait = wheelTime + Tick - now();
+	return (wait < 0 ? 0 : wait);
+}
+
+// Typing states are announced only when they change, and only once they
+// have held for the debounce delay, together with those of other nicks
+// in the channel.
+enum State { Done, Active, Paused };
+enum {
+	ActiveTimeout = 6 * 1000,
+	PausedTimeout = 30 * 1000,
+};
+static long debounce = 2000;
+
+struct Typing {
+	struct Timer expire;
+	struct Typing *next;
+	struct Chan *chan;
+	enum State state;
+	enum State shown;
+	char nick[];
+};
+
+static struct Chan {
+	struct Timer flush;
+	struct Chan *next;
+	struct Network *net;
+	struct Typing *typing;
+	char name[];
+} *chans;
+
+// Announcements are split into notices which each fit in an IRC line.
+static struct {
+	const char *chan;
+	size_t max;
+	char buf[512];
+	size_t len;
+} notice;
+
+static void noticeFlush(void) {
+	if (!notice.len) return;
+	format("NOTICE %s :%.*s\r\n", notice.chan, (int)notice.len, notice.buf);
+	notice.len = 0;
+}
+
+static void noticeAdd(const char *str, size_t len) {
+	if (notice.len && notice.len + 1 + len > notice.max) noticeFlush();
+	if (notice.len) notice.buf[notice.len++] = ' ';
+	if (len > notice.max - notice.len) len = notice.max - notice.len;
+	memcpy(&notice.buf[notice.len], str, len);
+	notice.len += len;
+}
+
+static void chanFlush(struct Timer *timer) {
+	struct Chan *chan = (struct Chan *)timer;
+	static const char *Verbs[][2] = {
+		[Done] = { "has given up :(", "have given up :(" },
+		[Active] = { "is typing...", "are typing..." },
+		[Paused] = { "is thinking hard...", "are thinking hard..." },
+	};
+	net = chan->net;
+	notice.chan = chan->name;
+	size_t chanLen = strlen(chan->name);
+	notice.max = (chanLen < 256 ? 510 - strlen("NOTICE  :") - chanLen : 0);
+
+	// Nicks in one state are listed together, in as many parts as fit.
+	for (enum State state = Done; state <= Paused; ++state) {
+		char buf[sizeof(notice.buf)];
+		size_t len = 0, n = 0;
+		size_t verb = 1 + strlen(Verbs[state][1]);
+		for (struct Typing *t = chan->typing; t; t = t->next) {
+			if (t->state != state || t->shown == state) continue;
+			size_t nick = strlen(t->nick);
+			if (n && len + 2 + nick + verb > notice.max) {
+				len += snprintf(
+					&buf[len], sizeof(buf) - len, " %s", Verbs[state][n > 1]
+				);
+				noticeAdd(buf, len);
+				len = n = 0;
+			}
+			if (2 + nick + verb > notice.max) continue;
+			len += snprintf(
+				&buf[len], sizeof(buf) - len, "%s%s", (n++ ? ", " : "* "),
+				t->nick
+			);
+		}
+		if (!n) continue;
+		len += snprintf(
+			&buf[len], sizeof(buf) - len, " %s", Verbs[state][n > 1]
+		);
+		noticeAdd(buf, len);
+	}
+	noticeFlush();
+
+	for (struct Typing **ptr = &chan->typing; *ptr;) {
+		struct Typing *t = *ptr;
+		t->shown = t->state;
+		if (t->state != Done) {
+			ptr = &t->next;
+			continue;
+		}
+		*ptr = t->next;
+		free(t);
+	}
+}
+
+static void typingExpire(struct Timer *timer) {
+	struct Typing *t = (struct Typing *)timer;
+	t->state = Done;
+	if (!t->chan->flush.prev) timerSet(&t->chan->flush, now() + debounce);
+}
+
+static struct Chan *chanFind(const char *name, bool create) {
+	struct Chan *chan;
+	for (chan = chans; chan; chan = chan->next) {
+		if (chan->net == net && !strcmp(chan->name, name)) return chan;
+	}
+	if (!create) return NULL;
+	chan = calloc(1, sizeof(*chan) + strlen(name) + 1);
+	if (!chan) err(1, "calloc");
+	chan->flush.fire = chanFlush;
+	chan->net = net;
+	strcpy(chan->name, name);
+	chan->next = chans;
+	chans = chan;
+	return chan;
+}
+
+static struct Typing *typingFind(
+	struct Chan *chan, const char *nick, bool create
+) {
+	struct Typing **ptr;
+	for (ptr = &chan->typing; *ptr; ptr = &(*ptr)->next) {
+		if (!strcmp((*ptr)->nick, nick)) return *ptr;
+	}
+	if (!create) return NULL;
+	struct Typing *t = calloc(1, sizeof(*t) + strlen(nick) + 1);
+	if (!t) err(1, "calloc");
+	t->expire.fire = typingExpire;
+	t->chan = chan;
+	strcpy(t->nick, nick);
+	*ptr = t;
+	return t;
+}
+
+// Nicks which are not typing are only tracked once they start.
+static void typingSet(const char *name, const char *nick, enum State state) {
+	struct Chan *chan = chanFind(name, state != Done);
+	if (!chan) return;
+	struct Typing *t = typingFind(chan, nick, state != Done);
+	if (!t) return;
+	if (state == Done) {
+		timerCancel(&t->expire);
+	} else {
+		timerSet(
+			&t->expire,
+			now() + (state == Active ? ActiveTimeout : PausedTimeout)
+		);
+	}
+	if (t->state == state) return;
+	t->state = state;
+	if (!chan->flush.prev) timerSet(&chan->flush, now() + debounce);
+}
+
+// A message ends typing without announcing it.
+static void typingClear(const char *name, const char *nick) {
+	for (struct Chan *chan = chans; chan; chan = chan->next) {
+		if (chan->net != net || strcmp(chan->name, name)) continue;
+		for (struct Typing *t = chan->typing; t; t = t->next) {
+			if (strcmp(t->nick, nick)) continue;
+			timerCancel(&t->expire);
+			t->state = Done;
+			t->shown = Done;
+		}
 	}
-	return NULL;
 }
 
 static void handle(char *ptr) {
@@ -104,7 +496,9 @@ static void handle(char *ptr) {
 		char *sub = strsep(&ptr, " ");
 		if (!sub) errx(1, "CAP without subcommand");
 		if (!strcmp(sub, "NAK")) {
-			errx(1, "server does not support %s", ptr);
+			warnx("%s: server does not support %s", net->host, ptr);
+			clientClose();
+			return;
 		} else if (!strcmp(sub, "ACK")) {
 			if (!ptr) errx(1, "CAP ACK without caps");
 			if (*ptr == ':') ptr++;
@@ -118,7 +512,7 @@ static void handle(char *ptr) {
 		if (!nick) errx(1, "ERR_NICKNAMEINUSE missing nick");
 		format("NICK %s_\r\n", nick);
 	} else if (!strcmp(cmd, "001")) {
-		if (join) format("JOIN %s\r\n", join);
+		if (net->join) format("JOIN %s\r\n", net->join);
 	} else if (!strcmp(cmd, "005")) {
 		char *self = strsep(&ptr, " ");
 		if (!self) errx(1, "RPL_ISUPPORT missing nick");
@@ -129,7 +523,7 @@ static void handle(char *ptr) {
 				format("MODE %s +%s\r\n", self, tok);
 			}
 		}
-	} else if (!strcmp(cmd, "INVITE") && invite) {
+	} else if (!strcmp(cmd, "INVITE") && net->invite) {
 		strsep(&ptr, " ");
 		if (!ptr) errx(1, "INVITE missing channel");
 		if (*ptr == ':') ptr++;
@@ -140,7 +534,9 @@ static void handle(char *ptr) {
 	} else if (!strcmp(cmd, "ERROR")) {
 		if (!ptr) errx(1, "ERROR missing parameter");
 		if (*ptr == ':') ptr++;
-		errx(1, "%s", ptr);
+		warnx("%s: %s", net->host, ptr);
+		clientClose();
+		return;
 	}
 
 	if (
@@ -165,6 +561,8 @@ static void handle(char *ptr) {
 		if (msg.mesg[len-1] == '\1') msg.mesg[len-1] = '\0';
 	}
 
+	if (msg.mesg) typingClear(msg.chan, msg.nick);
+
 	char *reply = NULL;
 	char *react = NULL;
 	char *typing = NULL;
@@ -196,13 +594,11 @@ static void handle(char *ptr) {
 
 	if (typing) {
 		if (!strcmp(typing, "active")) {
-			format("NOTICE %s :* %s is typing...\r\n", msg.chan, msg.nick);
+			typingSet(msg.chan, msg.nick, Active);
 		} else if (!strcmp(typing, "paused")) {
-			format(
-				"NOTICE %s :* %s is thinking hard...\r\n", msg.chan, msg.nick
-			);
+			typingSet(msg.chan, msg.nick, Paused);
 		} else if (!strcmp(typing, "done")) {
-			format("NOTICE %s :* %s has given up :(\r\n", msg.chan, msg.nick);
+			typingSet(msg.chan, msg.nick, Done);
 		} else {
 			format(
 				"NOTICE %s :* %s is doing some wacky %s typing!\r\n",
@@ -210,22 +606,22 @@ static void handle(char *ptr) {
 			);
 		}
 	} else if (react && reply) {
-		struct Message *to = find(reply);
+		struct Message to = find(reply);
 		format("NOTICE %s :* %s reacted to ", msg.chan, msg.nick);
-		if (to && strcmp(to->chan, msg.chan)) {
+		if (to.id && strcmp(to.chan, msg.chan)) {
 			format("a message in another channel");
-		} else if (to && to->mesg) {
+		} else if (to.id && to.mesg) {
 			size_t len = 0;
-			for (size_t n; to->mesg[len]; len += n) {
-				n = 1 + strcspn(&to->mesg[len+1], " ");
+			for (size_t n; to.mesg[len]; len += n) {
+				n = 1 + strcspn(&to.mesg[len+1], " ");
 				if (len + n > 50) break;
 			}
 			format(
 				"%s's message (\"%.*s\"%s)",
-				to->nick, (int)len, to->mesg, (to->mesg[len] ? "..." : "")
+				to.nick, (int)len, to.mesg, (to.mesg[len] ? "..." : "")
 			);
-		} else if (to) {
-			format("%s's reaction", to->nick);
+		} else if (to.id) {
+			format("%s's reaction", to.nick);
 		} else {
 			format("an unknown message");
 		}
@@ -236,126 +632,292 @@ static void handle(char *ptr) {
 			msg.chan, msg.nick, react
 		);
 	} else if (reply) {
-		struct Message *to = find(reply);
+		struct Message to = find(reply);
 		format("NOTICE %s :* %s was replying to ", msg.chan, msg.nick);
-		if (to && strcmp(to->chan, msg.chan)) {
+		if (to.id && strcmp(to.chan, msg.chan)) {
 			format("a message in another channel!\r\n");
-		} else if (to && to->mesg) {
+		} else if (to.id && to.mesg) {
 			size_t len = 0;
-			for (size_t n; to->mesg[len]; len += n) {
-				n = 1 + strcspn(&to->mesg[len+1], " ");
+			for (size_t n; to.mesg[len]; len += n) {
+				n = 1 + strcspn(&to.mesg[len+1], " ");
 				if (len + n > 50) break;
 			}
 			format(
 				"%s's message (\"%.*s\"%s)\r\n",
-				to->nick, (int)len, to->mesg, (to->mesg[len] ? "..." : "")
+				to.nick, (int)len, to.mesg, (to.mesg[len] ? "..." : "")
 			);
-		} else if (to) {
-			format("%s's reaction\r\n", to->nick);
+		} else if (to.id) {
+			format("%s's reaction\r\n", to.nick);
 		} else {
 			format("an unknown message!\r\n");
 		}
 	}
 }
 
-static void quit(int sig) {
+static volatile sig_atomic_t quit;
+static void signalQuit(int sig) {
 	(void)sig;
-	format("QUIT\r\n");
-	tls_close(client);
-	exit(0);
+	quit = 1;
 }
 
-int main(int argc, char *argv[]) {
-	const char *host = NULL;
-	const char *port = "6697";
-	const char *nick = "downgrade";
-	const char *cert = NULL;
-	const char *priv = NULL;
+// Failures only close the network, leaving the others running.
+static void clientConnect(struct tls_config *config) {
+	struct addrinfo *head;
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_protocol = IPPROTO_TCP,
+	};
+	int error = getaddrinfo(net->host, net->port, &hints, &head);
+	if (error) {
+		warnx("%s:%s: %s", net->host, net->port, gai_strerror(error));
+		return;
+	}
+
+	net->sock = -1;
+	for (struct addrinfo *ai = head; ai; ai = ai->ai_next) {
+		net->sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (net->sock < 0) err(1, "socket");
+
+		error = connect(net->sock, ai->ai_addr, ai->ai_addrlen);
+		if (!error) break;
+
+		close(net->sock);
+		net->sock = -1;
+	}
+	if (net->sock < 0) warn("%s:%s", net->host, net->port);
+	freeaddrinfo(head);
+	if (net->sock < 0) return;
+
+	net->client = tls_client();
+	if (!net->client) errx(1, "tls_client");
+
+	error = tls_configure(net->client, config);
+	if (error) errx(1, "tls_configure: %s", tls_error(net->client));
+
+	// The handshake blocks, then the socket is made non-blocking for the
+	// poll loop.
+	error = tls_connect_socket(net->client, net->sock, net->host);
+	if (error) {
+		warnx("%s: tls_connect: %s", net->host, tls_error(net->client));
+		clientClose();
+		return;
+	}
+	error = tls_handshake(net->client);
+	if (error) {
+		warnx("%s: tls_handshake: %s", net->host, tls_error(net->client));
+		clientClose();
+		return;
+	}
+
+	error = fcntl(net->sock, F_SETFL, O_NONBLOCK);
+	if (error) err(1, "fcntl");
+}
+
+// Reads until libtls needs to wait for the socket.
+static void clientRead(bool quitting) {
+	for (;;) {
+		ssize_t n = tls_read(
+			net->client, &net->buf[net->len], sizeof(net->buf) - net->len
+		);
+		if (n == TLS_WANT_POLLIN || n == TLS_WANT_POLLOUT) {
+			net->wantRead = (n == TLS_WANT_POLLIN ? POLLIN : POLLOUT);
+			return;
+		}
+		if (n <= 0) {
+			if (n < 0) {
+				warnx("%s: tls_read: %s", net->host, tls_error(net->client));
+			} else if (!quitting) {
+				warnx("%s: disconnected", net->host);
+			}
+			clientClose();
+			return;
+		}
+		net->len += n;
+
+		char *ptr = net->buf;
+		for (
+			char *crlf;
+			(crlf = memmem(ptr, &net->buf[net->len] - ptr, "\r\n", 2));
+			ptr = crlf + 2
+		) {
+			*crlf = '\0';
+			if (verbose) printf("%s\n", ptr);
+			handle(ptr);
+			if (net->sock < 0) return;
+		}
+		net->len -= ptr - net->buf;
+		memmove(net->buf, ptr, net->len);
+		if (net->len == sizeof(net->buf)) errx(1, "line too long");
+	}
+}
+
+static const char *Opts = "c:d:f:ij:k:n:p:s:v";
 
-	for (int opt; 0 < (opt = getopt(argc, argv, "c:ij:k:n:p:v"));) {
+// Returns the path given by -f, without adding a network.
+static const char *parse(int argc, char *argv[]) {
+	const char *path = NULL;
+	nets = realloc(nets, sizeof(*nets) * (netsLen + 1));
+	if (!nets) err(1, "realloc");
+	net = &nets[netsLen++];
+	*net = (struct Network) {
+		.port = "6697",
+		.nick = "downgrade",
+		.sock = -1,
+		.wantRead = POLLIN,
+	};
+	for (int opt; 0 < (opt = getopt(argc, argv, Opts));) {
 		switch (opt) {
-			break; case 'c': cert = optarg;
-			break; case 'i': invite = true;
-			break; case 'j': join = optarg;
-			break; case 'k': priv = optarg;
-			break; case 'n': nick = optarg;
-			break; case 'p': port = optarg;
+			break; case 'c': net->cert = optarg;
+			break; case 'd': debounce = strtol(optarg, NULL, 10);
+			break; case 'f': path = optarg;
+			break; case 'i': net->invite = true;
+			break; case 'j': net->join = optarg;
+			break; case 'k': net->priv = optarg;
+			break; case 'n': net->nick = optarg;
+			break; case 'p': net->port = optarg;
+			break; case 's': historyCap = strtoul(optarg, NULL, 10);
 			break; case 'v': verbose = true;
-			break; default:  return 1;
+			break; default:  exit(1);
 		}
 	}
+	if (path) {
+		netsLen--;
+		return path;
+	}
 	if (optind == argc) errx(1, "host required");
-	host = argv[optind];
-
-	client = tls_client();
-	if (!client) errx(1, "tls_client");
-
-	struct tls_config *config = tls_config_new();
-	if (!config) errx(1, "tls_config_new");
+	net->host = argv[optind];
+	return NULL;
+}
 
-	if (cert) {
-		if (!priv) priv = cert;
-		int error = tls_config_set_keypair_file(config, cert, priv);
-		if (error) errx(1, "%s: %s", cert, tls_config_error(config));
+// Each line of the file holds the options and host of one network. Lines
+// starting with # are ignored.
+static void parseFile(const char *path) {
+	FILE *file = fopen(path, "r");
+	if (!file) err(1, "%s", path);
+	char *buf = NULL;
+	size_t cap = 0;
+	while (0 < getline(&buf, &cap, file)) {
+		char *line = strdup(buf);
+		if (!line) err(1, "strdup");
+		int argc = 1;
+		char *argv[64] = { "downgrade" };
+		for (char *word; (word = strsep(&line, " \t\n"));) {
+			if (argc == 1 && word[0] == '#') break;
+			if (!word[0]) continue;
+			if (argc == 63) errx(1, "%s: too many options", path);
+			argv[argc++] = word;
+		}
+		if (argc == 1) continue;
+#ifdef __GLIBC__
+		optind = 0;
+#else
+		optind = 1;
+		optreset = 1;
+#endif
+		if (parse(argc, argv)) errx(1, "%s: -f in file", path);
 	}
+	if (ferror(file)) err(1, "%s", path);
+	free(buf);
+	fclose(file);
+}
 
-	int error = tls_configure(client, config);
-	if (error) errx(1, "tls_configure: %s", tls_error(client));
-
-	error = tls_connect(client, host, port);
-	if (error) errx(1, "tls_connect: %s", tls_error(client));
+int main(int argc, char *argv[]) {
+	const char *path = parse(argc, argv);
+	if (path) parseFile(path);
+	if (!netsLen) errx(1, "no networks");
+	if (netsLen > UINT16_MAX) errx(1, "too many networks");
+	if (!historyCap || historyCap > UINT32_MAX / 2) {
+		errx(1, "invalid history size");
+	}
+	historyAlloc();
+	if (debounce < 0) errx(1, "invalid debounce delay");
+	wheelTime = now() / Tick * Tick;
 
-	do {
-		error = tls_handshake(client);
-	} while (error == TLS_WANT_POLLIN || error == TLS_WANT_POLLOUT);
-	if (error) errx(1, "tls_handshake: %s", tls_error(client));
-	tls_config_clear_keys(config);
+	// Networks without client certificates share one configuration.
+	struct tls_config *shared = tls_config_new();
+	if (!shared) errx(1, "tls_config_new");
+	for (net = nets; net < &nets[netsLen]; ++net) {
+		struct tls_config *config = shared;
+		if (net->cert) {
+			config = tls_config_new();
+			if (!config) errx(1, "tls_config_new");
+			if (!net->priv) net->priv = net->cert;
+			int error = tls_config_set_keypair_file(
+				config, net->cert, net->priv
+			);
+			if (error) {
+				errx(1, "%s: %s", net->cert, tls_config_error(config));
+			}
+		}
+		clientConnect(config);
+		if (config != shared) {
+			tls_config_clear_keys(config);
+			tls_config_free(config);
+		}
+	}
+	tls_config_free(shared);
 
 #ifdef __OpenBSD__
-	error = pledge("stdio", NULL);
+	int error = pledge("stdio", NULL);
 	if (error) err(1, "pledge");
 #endif
 
 #ifdef __FreeBSD__
-	error = caph_enter() || caph_limit_stdio();
+	int error = caph_enter() || caph_limit_stdio();
 	if (error) err(1, "caph_enter");
 #endif
 
-	signal(SIGHUP, quit);
-	signal(SIGINT, quit);
-	signal(SIGTERM, quit);
-	format(
-		"CAP REQ :echo-message message-tags\r\n"
-		"NICK %s\r\n"
-		"USER %s 0 * :https://causal.agency/bin/downgrade.html\r\n",
-		nick, nick
-	);
-	if (cert) {
-		format("CAP REQ sasl\r\n");
-	} else {
-		format("CAP END\r\n");
+	signal(SIGHUP, signalQuit);
+	signal(SIGINT, signalQuit);
+	signal(SIGTERM, signalQuit);
+	for (net = nets; net < &nets[netsLen]; ++net) {
+		if (net->sock < 0) continue;
+		format(
+			"CAP REQ :echo-message message-tags\r\n"
+			"NICK %s\r\n"
+			"USER %s 0 * :https://causal.agency/bin/downgrade.html\r\n",
+			net->nick, net->nick
+		);
+		if (net->cert) {
+			format("CAP REQ sasl\r\n");
+		} else {
+			format("CAP END\r\n");
+		}
+		net->want = clientFlush();
 	}
 
-	size_t len = 0;
-	char buf[BufferCap];
-	for (;;) {
-		ssize_t n = tls_read(client, &buf[len], sizeof(buf) - len);
-		if (n == TLS_WANT_POLLIN || n == TLS_WANT_POLLOUT) continue;
-		if (n < 0) errx(1, "tls_read: %s", tls_error(client));
-		if (!n) errx(1, "disconnected");
-		len += n;
+	struct pollfd *fds = calloc(netsLen, sizeof(*fds));
+	if (!fds) err(1, "calloc");
+	for (bool quitting = false;;) {
+		size_t open = 0;
+		for (size_t i = 0; i < netsLen; ++i) {
+			fds[i].fd = nets[i].sock;
+			fds[i].events = nets[i].want | nets[i].wantRead;
+			if (nets[i].sock >= 0) open++;
+		}
+		if (!open) return (quitting ? 0 : 1);
 
-		char *ptr = buf;
-		for (
-			char *crlf;
-			(crlf = memmem(ptr, &buf[len] - ptr, "\r\n", 2));
-			ptr = crlf + 2
-		) {
-			*crlf = '\0';
-			if (verbose) printf("%s\n", ptr);
-			handle(ptr);
+		int nfds = poll(fds, netsLen, wheelWait());
+		if (nfds < 0 && errno != EINTR) err(1, "poll");
+		wheelRun(now());
+
+		if (quit && !quitting) {
+			for (net = nets; net < &nets[netsLen]; ++net) {
+				if (net->sock >= 0) format("QUIT\r\n");
+			}
+			quitting = true;
+		}
+
+		for (size_t i = 0; nfds > 0 && i < netsLen; ++i) {
+			net = &nets[i];
+			if (!fds[i].revents || net->sock < 0) continue;
+			clientRead(quitting);
+		}
+
+		for (net = nets; net < &nets[netsLen]; ++net) {
+			net->want = clientFlush();
+			if (quitting && net->sock >= 0 && !net->want) clientClose();
 		}
-		len -= ptr - buf;
-		memmove(buf, ptr, len);
 	}
 }
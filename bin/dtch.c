@@ -87,6 +87,78 @@ static void handler(int sig) {
 	_exit(-sig);
 }
 
+// Output is kept in a ring to be replayed on attach, and is written to
+// the client from the ring as its socket allows, so a slow client never
+// blocks reading the pty. A client which falls a whole ring behind skips
+// ahead.
+enum { ScrollbackCap = 64 * 1024 };
+static struct {
+	char buf[ScrollbackCap];
+	size_t total;
+	size_t sent;
+} scrollback;
+
+static void scrollbackPush(const char *ptr, size_t len) {
+	if (len > ScrollbackCap) {
+		scrollback.total += len - ScrollbackCap;
+		ptr += len - ScrollbackCap;
+		len = ScrollbackCap;
+	}
+	while (len) {
+		size_t pos = scrollback.total % ScrollbackCap;
+		size_t n = ScrollbackCap - pos;
+		if (n > len) n = len;
+		memcpy(&scrollback.buf[pos], ptr, n);
+		scrollback.total += n;
+		ptr += n;
+		len -= n;
+	}
+}
+
+// Once the ring has wrapped, output starts after the oldest newline so as
+// not to begin in the middle of an escape sequence.
+static size_t scrollbackOldest(void) {
+	if (scrollback.total <= ScrollbackCap) return 0;
+	size_t i = scrollback.total - ScrollbackCap;
+	for (; i < scrollback.total; ++i) {
+		if (scrollback.buf[i % ScrollbackCap] == '\n') return i + 1;
+	}
+	return scrollback.total;
+}
+
+// Writes to the client until its socket would block. Returns -1 on error.
+static int scrollbackFlush(int client) {
+	if (scrollback.total - scrollback.sent > ScrollbackCap) {
+		scrollback.sent = scrollbackOldest();
+	}
+	while (scrollback.sent < scrollback.total) {
+		size_t pos = scrollback.sent % ScrollbackCap;
+		size_t n = ScrollbackCap - pos;
+		if (n > scrollback.total - scrollback.sent) {
+			n = scrollback.total - scrollback.sent;
+		}
+		ssize_t len = write(client, &scrollback.buf[pos], n);
+		if (len < 0) return (errno == EAGAIN ? 0 : -1);
+		scrollback.sent += len;
+	}
+	return 0;
+}
+
+// SIGCHLD writes to a pipe so that poll wakes to reap the command.
+static int reaper[2];
+static void reap(int sig) {
+	(void)sig;
+	int save = errno;
+	ssize_t len = write(reaper[1], "", 1);
+	(void)len;
+	errno = save;
+}
+
+// The pty is read here whether or not a client is attached, so output is
+// recorded in the scrollback and forwarded to the client. The client is
+// sent the pty itself to write input and set the window size. Once the
+// command has exited, its remaining output is read and flushed to the
+// client before exiting.
 static void detach(int server, bool sink, char *argv[]) {
 	int pty;
 	pid_t pid = forkpty(&pty, NULL, NULL, NULL);
@@ -97,45 +169,89 @@ static void detach(int server, bool sink, char *argv[]) {
 		err(127, "%s", argv[0]);
 	}
 
+	int error = pipe(reaper);
+	if (error) err(1, "pipe");
+	error = fcntl(reaper[0], F_SETFL, O_NONBLOCK)
+		|| fcntl(reaper[1], F_SETFL, O_NONBLOCK);
+	if (error) err(1, "fcntl");
+
 	signal(SIGINT, handler);
 	signal(SIGTERM, handler);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGCHLD, reap);
 
-	int error = listen(server, 0);
+	error = listen(server, 0);
 	if (error) err(1, "listen");
 
+	int client = -1;
+	pid_t dead = 0;
+	int status;
 	struct pollfd fds[] = {
 		{ .events = POLLIN, .fd = server },
 		{ .events = POLLIN, .fd = pty },
+		{ .events = POLLIN, .fd = reaper[0] },
 	};
-	while (0 < poll(fds, (sink ? 2 : 1), -1)) {
-		if (fds[0].revents) {
-			int client = accept(server, NULL, NULL);
+	for (;;) {
+		bool flushed = (client < 0 || scrollback.sent == scrollback.total);
+		fds[0].fd = (client < 0 ? server : client);
+		fds[0].events = (flushed ? POLLIN : POLLIN | POLLOUT);
+		int nfds = poll(fds, 3, (dead && flushed ? 0 : -1));
+		if (nfds < 0 && errno != EINTR) err(1, "poll");
+
+		if (nfds > 0 && fds[0].revents && client < 0) {
+			client = accept(server, NULL, NULL);
 			if (client < 0) err(1, "accept");
 
 			ssize_t len = sendfd(client, pty);
 			if (len < 0) warn("sendfd");
-
-			len = recv(client, &_, sizeof(_), 0);
-			if (len < 0) warn("recv");
-
+			error = fcntl(client, F_SETFL, O_NONBLOCK);
+			if (error) err(1, "fcntl");
+			scrollback.sent = (sink ? scrollback.total : scrollbackOldest());
+			if (len < 0 || scrollbackFlush(client)) {
+				close(client);
+				client = -1;
+			}
+		} else if (nfds > 0 && (fds[0].revents & ~POLLOUT)) {
 			close(client);
+			client = -1;
+		} else if (nfds > 0 && fds[0].revents) {
+			if (scrollbackFlush(client)) {
+				close(client);
+				client = -1;
+			}
 		}
 
-		if (fds[1].revents) {
+		// The pty reads EIO on Linux once the command has exited.
+		if (nfds > 0 && fds[1].revents) {
 			char buf[4096];
 			ssize_t len = read(pty, buf, sizeof(buf));
-			if (len < 0) err(1, "read");
+			if (len < 0 && errno != EIO) err(1, "read");
+			if (len > 0) {
+				scrollbackPush(buf, len);
+				if (client >= 0 && scrollbackFlush(client)) {
+					close(client);
+					client = -1;
+				}
+			} else {
+				fds[1].fd = -1;
+			}
 		}
 
-		int status;
-		pid_t dead = waitpid(pid, &status, WNOHANG);
-		if (dead < 0) err(1, "waitpid");
-		if (dead) {
-			unlink(addr.sun_path);
-			exit(WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status));
+		if (nfds > 0 && fds[2].revents) {
+			char buf[64];
+			while (0 < read(reaper[0], buf, sizeof(buf)));
+		}
+		if (!dead) {
+			dead = waitpid(pid, &status, WNOHANG);
+			if (dead < 0) err(1, "waitpid");
 		}
+
+		// Exit only once the pty is idle and the client has everything.
+		if (nfds < 0 || !dead || fds[1].revents) continue;
+		if (client >= 0 && scrollback.sent < scrollback.total) continue;
+		unlink(addr.sun_path);
+		exit(WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status));
 	}
-	err(1, "poll");
 }
 
 static struct termios saveTerm;
@@ -181,7 +297,7 @@ static void attach(int client) {
 	char buf[4096];
 	struct pollfd fds[] = {
 		{ .events = POLLIN, .fd = STDIN_FILENO },
-		{ .events = POLLIN, .fd = pty },
+		{ .events = POLLIN, .fd = client },
 	};
 	for (;;) {
 		int nfds = poll(fds, 2, -1);
@@ -209,7 +325,7 @@ static void attach(int client) {
 		}
 
 		if (fds[1].revents) {
-			ssize_t len = read(pty, buf, sizeof(buf));
+			ssize_t len = read(client, buf, sizeof(buf));
 			if (len < 0) err(1, "read");
 			if (!len) break;
 
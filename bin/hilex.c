@@ -17,11 +17,14 @@
 #include <assert.h>
 #include <ctype.h>
 #include <err.h>
+#include <limits.h>
 #include <regex.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -41,7 +44,64 @@ static int yylex(void) {
 	static size_t cap = 0;
 	return (getline(&yytext, &cap, yyin) < 0 ? None : Normal);
 }
-static const struct Lexer LexText = { yylex, &yyin, &yytext };
+static int textSave(void) {
+	return 0;
+}
+static void textRestore(int state) {
+	(void)state;
+}
+static const struct Lexer LexText = {
+	yylex, &yyin, &yytext, textSave, textRestore,
+};
+
+// Each token is its class in one byte, the length of its text as a
+// little-endian base-128 integer, then the text itself.
+static void writeSize(FILE *file, size_t size) {
+	for (; size > 0x7F; size >>= 7) {
+		putc(0x80 | (size & 0x7F), file);
+	}
+	putc(size, file);
+}
+
+static void writeToken(FILE *file, int class, const char *text, size_t len) {
+	putc(class, file);
+	writeSize(file, len);
+	fwrite(text, len, 1, file);
+}
+
+static size_t readSize(FILE *file) {
+	size_t size = 0;
+	for (int shift = 0, ch; shift < 64; shift += 7) {
+		if (EOF == (ch = getc(file))) errx(1, "truncated token");
+		size |= (size_t)(ch & 0x7F) << shift;
+		if (!(ch & 0x80)) break;
+	}
+	return size;
+}
+
+static void readText(FILE *file, char **buf, size_t *cap, size_t len) {
+	if (len >= *cap) {
+		*cap = len + 1;
+		*buf = realloc(*buf, *cap);
+		if (!*buf) err(1, "realloc");
+	}
+	if (fread(*buf, 1, len, file) < len) errx(1, "truncated token");
+	(*buf)[len] = '\0';
+}
+
+static FILE *tokenIn;
+static char *tokenText;
+static int tokenLex(void) {
+	static size_t cap = 0;
+	int class = getc(tokenIn);
+	if (class == EOF) return None;
+	if (class <= None || class >= ClassCap) errx(1, "invalid token class");
+	readText(tokenIn, &tokenText, &cap, readSize(tokenIn));
+	return class;
+}
+static const struct Lexer LexToken = {
+	tokenLex, &tokenIn, &tokenText, NULL, NULL,
+};
 
 static const struct {
 	const struct Lexer *lexer;
@@ -54,6 +114,7 @@ static const struct {
 	{ &LexMdoc, "mdoc", "[.][1-9]$", "^[.]Dd" },
 	{ &LexSh, "sh", "[.]sh$|^[.](profile|shrc)$", "^#![ ]?/bin/k?sh" },
 	{ &LexText, "text", "[.]txt$", NULL },
+	{ &LexToken, "token", NULL, NULL },
 };
 
 static const struct Lexer *parseLexer(const char *name) {
@@ -75,6 +136,7 @@ static const struct Lexer *matchLexer(const char *name, FILE *file) {
 	char buf[256];
 	regex_t regex;
 	for (size_t i = 0; i < ARRAY_LEN(Lexers); ++i) {
+		if (!Lexers[i].namePatt) continue;
 		int error = regcomp(
 			&regex, Lexers[i].namePatt, REG_EXTENDED | REG_NOSUB
 		);
@@ -109,6 +171,7 @@ static const struct Lexer *matchLexer(const char *name, FILE *file) {
 	X(Pre, "pre") \
 	X(Style, "style") \
 	X(Tab, "tab") \
+	X(Tags, "tags") \
 	X(Title, "title")
 
 enum Option {
@@ -313,6 +376,27 @@ static void htmlFormat(const char *opts[], enum Class class, const char *text) {
 	}
 }
 
+static void htmlId(const char *tag) {
+	for (const char *ch = tag; *ch; ++ch) {
+		putchar(isalnum(*ch) || strchr("-._", *ch) ? *ch : '_');
+	}
+}
+
+static void htmlTag(const char *tag) {
+	printf("<a class=\"tag\" id=\"");
+	htmlId(tag);
+	printf("\" href=\"#");
+	htmlId(tag);
+	printf("\">");
+}
+
+static void tokenFormat(
+	const char *opts[], enum Class class, const char *text
+) {
+	(void)opts;
+	writeToken(stdout, class, text, strlen(text));
+}
+
 static const struct Formatter {
 	const char *name;
 	Header *header;
@@ -323,6 +407,7 @@ static const struct Formatter {
 	{ "debug", NULL, debugFormat, NULL },
 	{ "html", htmlHeader, htmlFormat, htmlFooter },
 	{ "irc", ircHeader, ircFormat, NULL },
+	{ "token", NULL, tokenFormat, NULL },
 };
 
 static const struct Formatter *parseFormatter(const char *name) {
@@ -339,16 +424,259 @@ static char *const OptionKeys[OptionCap + 1] = {
 	NULL,
 };
 
+static int *states;
+static size_t statesLen, statesCap;
+
+static void pushState(int state) {
+	if (statesLen == statesCap) {
+		statesCap = (statesCap ? statesCap * 2 : 256);
+		states = realloc(states, sizeof(*states) * statesCap);
+		if (!states) err(1, "realloc");
+	}
+	states[statesLen++] = state;
+}
+
+static void readStates(const char *path) {
+	FILE *file = fopen(path, "r");
+	if (!file) err(1, "%s", path);
+	char *buf = NULL;
+	size_t cap = 0;
+	while (0 < getline(&buf, &cap, file)) {
+		pushState(buf[0] == '-' ? -1 : (int)strtol(buf, NULL, 10));
+	}
+	if (ferror(file)) err(1, "%s", path);
+	if (!statesLen) errx(1, "%s: no states", path);
+	fclose(file);
+	free(buf);
+}
+
+static void writeStates(const char *path) {
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	FILE *file = fopen(tmp, "w");
+	if (!file) err(1, "%s", tmp);
+	for (size_t i = 0; i < statesLen; ++i) {
+		if (states[i] < 0) {
+			fprintf(file, "-\n");
+		} else {
+			fprintf(file, "%d\n", states[i]);
+		}
+	}
+	int error = fclose(file);
+	if (error) err(1, "%s", tmp);
+	error = rename(tmp, path);
+	if (error) err(1, "%s", path);
+}
+
+static size_t countLines(FILE *file, const char *path) {
+	off_t start = ftello(file);
+	if (start < 0) err(1, "%s", path);
+	size_t lines = 1;
+	char buf[4096];
+	for (size_t len; (len = fread(buf, 1, sizeof(buf), file));) {
+		for (
+			char *ptr = buf;
+			(ptr = memchr(ptr, '\n', &buf[len] - ptr));
+			++ptr
+		) lines++;
+	}
+	if (ferror(file)) err(1, "%s", path);
+	int error = fseeko(file, start, SEEK_SET);
+	if (error) err(1, "%s", path);
+	return lines;
+}
+
+// Parallel highlighting lexes segments of the file in separate processes,
+// each assuming the initial state at its start. Segments are joined where
+// the state at a line start matches, otherwise the following segment is
+// lexed again from the correct state.
+
+enum { SegmentMin = 64 * 1024 };
+
+// Between tokens, segment output contains None records holding the state at
+// each line start, plus one.
+static void writeState(FILE *file, int state) {
+	putc(None, file);
+	writeSize(file, state + 1);
+}
+
+static void lexSegment(
+	const struct Lexer *lexer, const char *path,
+	off_t start, int state, off_t limit, FILE *out
+) {
+	FILE *file = fopen(path, "r");
+	if (!file) err(1, "%s", path);
+	int error = fseeko(file, start, SEEK_SET);
+	if (error) err(1, "%s", path);
+
+	lexer->restore(state);
+	*lexer->in = file;
+	writeState(out, state);
+	for (enum Class class; None != (class = lexer->lex());) {
+		const char *text = *lexer->text;
+		size_t len = strlen(text);
+		writeToken(out, class, text, len);
+		start += len;
+		if (!len || text[len-1] != '\n') continue;
+		state = lexer->save();
+		writeState(out, state);
+		if (start >= limit && state >= 0) break;
+	}
+	error = fflush(out);
+	if (error) err(1, "tmpfile");
+}
+
+static FILE *forkSegment(
+	const struct Lexer *lexer, const char *path,
+	off_t start, int state, off_t limit, pid_t *pid
+) {
+	FILE *out = tmpfile();
+	if (!out) err(1, "tmpfile");
+	fflush(stdout);
+	*pid = fork();
+	if (*pid < 0) err(1, "fork");
+	if (!*pid) {
+		lexSegment(lexer, path, start, state, limit, out);
+		_exit(0);
+	}
+	return out;
+}
+
+static void waitSegment(pid_t pid, FILE *out) {
+	int status;
+	pid_t dead = waitpid(pid, &status, 0);
+	if (dead < 0) err(1, "waitpid");
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) exit(1);
+	rewind(out);
+}
+
+// Skips segment output up to the line start at offset, returning whether
+// the segment's state there matches.
+static bool seekSegment(FILE *out, off_t pos, off_t offset, int state) {
+	for (int class; EOF != (class = getc(out));) {
+		size_t size = readSize(out);
+		if (class == None) {
+			if (pos == offset) return (int)size - 1 == state;
+			if (pos > offset) return false;
+			continue;
+		}
+		int error = fseeko(out, size, SEEK_CUR);
+		if (error) err(1, "tmpfile");
+		pos += size;
+	}
+	return false;
+}
+
+static void highlightParallel(
+	const struct Lexer *lexer, const struct Formatter *formatter,
+	const char *opts[], const char *path, size_t jobs, bool saveStates
+) {
+	FILE *file = fopen(path, "r");
+	if (!file) err(1, "%s", path);
+	struct stat st;
+	int error = fstat(fileno(file), &st);
+	if (error) err(1, "%s", path);
+	if (jobs > (size_t)st.st_size / SegmentMin + 1) {
+		jobs = st.st_size / SegmentMin + 1;
+	}
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1) cpus = 1;
+	if (jobs > (size_t)cpus) jobs = cpus;
+
+	off_t *starts = calloc(jobs + 1, sizeof(*starts));
+	pid_t *pids = calloc(jobs, sizeof(*pids));
+	FILE **outs = calloc(jobs, sizeof(*outs));
+	if (!starts || !pids || !outs) err(1, "calloc");
+	starts[0] = 0;
+	starts[jobs] = st.st_size;
+	for (size_t i = 1; i < jobs; ++i) {
+		error = fseeko(file, st.st_size / jobs * i, SEEK_SET);
+		if (error) err(1, "%s", path);
+		for (int ch; EOF != (ch = getc(file)) && ch != '\n';);
+		starts[i] = ftello(file);
+	}
+	fclose(file);
+
+	int state = lexer->save();
+	for (size_t i = 0; i < jobs; ++i) {
+		outs[i] = forkSegment(
+			lexer, path, starts[i], state, starts[i+1], &pids[i]
+		);
+	}
+	for (size_t i = 0; i < jobs; ++i) {
+		waitSegment(pids[i], outs[i]);
+	}
+
+	char *buf = NULL;
+	size_t cap = 0;
+	off_t offset = 0;
+	FILE *out = outs[0];
+	for (size_t i = 0;;) {
+		for (int class; EOF != (class = getc(out));) {
+			size_t size = readSize(out);
+			if (class == None) {
+				state = size - 1;
+				if (saveStates) pushState(state);
+				continue;
+			}
+			if (class >= ClassCap) errx(1, "invalid token class");
+			readText(out, &buf, &cap, size);
+			offset += size;
+			formatter->format(opts, class, buf);
+			if (!saveStates) continue;
+			for (char *nl = buf; (nl = strchr(nl, '\n')) && *++nl;) {
+				pushState(-1);
+			}
+		}
+		if (++i == jobs || offset >= st.st_size) break;
+		out = outs[i];
+		if (seekSegment(out, starts[i], offset, state)) continue;
+		pid_t pid;
+		out = forkSegment(
+			lexer, path, offset, state, starts[i+1], &pid
+		);
+		waitSegment(pid, out);
+		seekSegment(out, offset, offset, state);
+	}
+	for (size_t i = 0; i < jobs; ++i) {
+		fclose(outs[i]);
+	}
+	free(buf);
+	free(outs);
+	free(pids);
+	free(starts);
+}
+
+static void highlightTags(const struct Lexer *lexer, const char *opts[]) {
+	tokenize(lexer);
+	if (lexer == &LexC) tagC();
+	if (lexer == &LexMake) tagMake();
+	if (lexer == &LexMdoc) tagMdoc();
+	if (lexer == &LexSh) tagSh();
+
+	for (size_t i = 0; i < tokensLen; ++i) {
+		if (tokens[i].tag) htmlTag(tokens[i].tag);
+		htmlFormat(opts, tokens[i].class, tokens[i].text);
+		if (tokens[i].close) printf("</a>");
+	}
+}
+
 int main(int argc, char *argv[]) {
 	bool text = false;
 	const char *name = NULL;
 	const struct Lexer *lexer = NULL;
 	const struct Formatter *formatter = &Formatters[0];
 	const char *opts[OptionCap] = {0};
+	const char *statesPath = NULL;
+	size_t jobs = 1;
+	bool range = false;
+	size_t first = 1, last = SIZE_MAX;
 
-	for (int opt; 0 < (opt = getopt(argc, argv, "f:l:n:o:t"));) {
+	for (int opt; 0 < (opt = getopt(argc, argv, "c:f:j:l:n:o:r:t"));) {
 		switch (opt) {
+			break; case 'c': statesPath = optarg;
 			break; case 'f': formatter = parseFormatter(optarg);
+			break; case 'j': jobs = strtoul(optarg, NULL, 10);
 			break; case 'l': lexer = parseLexer(optarg);
 			break; case 'n': name = optarg;
 			break; case 'o': {
@@ -359,10 +687,26 @@ int main(int argc, char *argv[]) {
 					opts[key] = (val ? val : "");
 				}
 			}
+			break; case 'r': {
+				range = true;
+				first = strtoul(optarg, &optarg, 10);
+				if (*optarg++ != ',') errx(1, "invalid range");
+				last = strtoul(optarg, &optarg, 10);
+				if (*optarg || !first || last < first) {
+					errx(1, "invalid range");
+				}
+			}
 			break; case 't': text = true;
 			break; default:  return 1;
 		}
 	}
+	if (range && !statesPath) errx(1, "range requires a state file");
+	if (range && jobs > 1) errx(1, "range cannot be highlighted in parallel");
+	if (!jobs) errx(1, "invalid number of jobs");
+	if (formatter->format != htmlFormat) opts[Tags] = NULL;
+	if (opts[Tags] && (range || jobs > 1)) {
+		errx(1, "tags require highlighting the whole input");
+	}
 
 	const char *path = "(stdin)";
 	FILE *file = stdin;
@@ -373,13 +717,27 @@ int main(int argc, char *argv[]) {
 		pager = isatty(STDOUT_FILENO);
 	}
 
+	// States of the previous input, and the difference in its line count:
+	int *prev = NULL;
+	size_t prevLen = 0;
+	ssize_t delta = 0;
+	if (range) {
+		readStates(statesPath);
+		prev = states;
+		prevLen = statesLen;
+		states = NULL;
+		statesLen = statesCap = 0;
+		delta = (ssize_t)countLines(file, path) - (ssize_t)prevLen;
+	}
+
 #ifdef __OpenBSD__
-	int error;
+	char promises[64] = "stdio";
 	if (formatter->header == ansiHeader && pager) {
-		error = pledge("stdio proc exec", NULL);
-	} else {
-		error = pledge("stdio", NULL);
+		strlcat(promises, " proc exec", sizeof(promises));
 	}
+	if (statesPath) strlcat(promises, " wpath cpath", sizeof(promises));
+	if (jobs > 1) strlcat(promises, " rpath tmppath proc", sizeof(promises));
+	int error = pledge(promises, NULL);
 	if (error) err(1, "pledge");
 #endif
 
@@ -394,12 +752,68 @@ int main(int argc, char *argv[]) {
 	if (!lexer) lexer = matchLexer(name, file);
 	if (!lexer && text) lexer = &LexText;
 	if (!lexer) errx(1, "cannot infer lexer for %s", name);
+	if (statesPath && !lexer->save) errx(1, "cannot save lexer state");
+	if (jobs > 1 && !lexer->save) errx(1, "cannot highlight in parallel");
+	if (jobs > 1 && file == stdin) {
+		errx(1, "cannot highlight standard input in parallel");
+	}
+
+	// Resume from the last checkpoint at or before the first changed line,
+	// which is unaffected by the change.
+	size_t line = 1;
+	if (range) {
+		line = (first < prevLen ? first : prevLen);
+		while (line > 1 && prev[line-1] < 0) line--;
+		for (size_t i = 0; i < line - 1; ++i) {
+			pushState(prev[i]);
+		}
+		char *buf = NULL;
+		size_t cap = 0;
+		for (size_t i = 1; i < line; ++i) {
+			if (getline(&buf, &cap, file) < 0) err(1, "%s", path);
+		}
+		free(buf);
+		if (prev[line-1] >= 0) lexer->restore(prev[line-1]);
+	}
+	if (statesPath && jobs == 1) pushState(lexer->save());
 
 	*lexer->in = file;
 	if (formatter->header) formatter->header(opts);
+	if (jobs > 1) {
+		highlightParallel(lexer, formatter, opts, path, jobs, statesPath);
+		goto done;
+	}
+	if (opts[Tags]) {
+		highlightTags(lexer, opts);
+		goto done;
+	}
 	for (enum Class class; None != (class = lexer->lex());) {
 		assert(class < ClassCap);
-		formatter->format(opts, class, *lexer->text);
+		bool bol = false;
+		const char *text = *lexer->text;
+		for (const char *nl = text; (nl = strchr(nl, '\n'));) {
+			nl++;
+			line++;
+			if (line <= first) text = nl;
+			bol = !*nl;
+			if (statesPath) pushState(bol ? lexer->save() : -1);
+		}
+		if (line >= first && *text) formatter->format(opts, class, text);
+
+		// Stop once the state after the changed lines matches the previous
+		// state of the same line.
+		if (!range || !bol || line <= last) continue;
+		if ((ssize_t)line - delta < 1) continue;
+		size_t i = line - delta;
+		if (i > prevLen || prev[i-1] < 0) continue;
+		if (prev[i-1] != states[statesLen-1]) continue;
+		for (; i < prevLen; ++i) {
+			pushState(prev[i]);
+		}
+		break;
 	}
+
+done:
 	if (formatter->footer) formatter->footer(opts);
+	if (statesPath) writeStates(statesPath);
 }
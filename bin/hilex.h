@@ -14,6 +14,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 
 #define ENUM_CLASS \
@@ -38,13 +40,34 @@ enum Class {
 };
 
 typedef int Lex(void);
+typedef int Save(void);
+typedef void Restore(int state);
 struct Lexer {
 	Lex *lex;
 	FILE **in;
 	char **text;
+	// Line-start state, or -1 if lexing cannot be resumed there:
+	Save *save;
+	Restore *restore;
 };
 
 extern const struct Lexer LexC;
 extern const struct Lexer LexMake;
 extern const struct Lexer LexMdoc;
 extern const struct Lexer LexSh;
+
+// Tokens of a whole input, for finding definitions:
+struct Token {
+	enum Class class;
+	char *text;
+	char *tag;
+	bool close;
+};
+extern struct Token *tokens;
+extern size_t tokensLen;
+void tokenize(const struct Lexer *lexer);
+void untokenize(void);
+void tagC(void);
+void tagMake(void);
+void tagMdoc(void);
+void tagSh(void);
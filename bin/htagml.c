@@ -16,10 +16,14 @@
 
 #include <ctype.h>
 #include <err.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 static char *deregex(const char *patt) {
@@ -65,19 +69,286 @@ static void id(const char *tag) {
 	}
 }
 
-static char *hstrstr(const char *haystack, const char *needle) {
-	while (haystack) {
-		char *elem = strchr(haystack, '<');
-		char *match = strstr(haystack, needle);
-		if (!match) return NULL;
-		if (!elem || match < elem) return match;
-		haystack = strchr(elem, '>');
+static int isident(int c) {
+	return isalnum(c) || c == '_';
+}
+
+// Finds needle as a whole identifier, skipping over markup if html is set,
+// in a single pass over str.
+static char *find(char *str, const char *needle, bool html) {
+	size_t len = strlen(needle);
+	bool markup = false;
+	for (char *ptr = str; *ptr; ++ptr) {
+		if (markup) {
+			if (*ptr == '>') markup = false;
+			continue;
+		}
+		if (html && *ptr == '<') {
+			markup = true;
+			continue;
+		}
+		if (*ptr != needle[0] || strncmp(ptr, needle, len)) continue;
+		if (ptr > str && isident(ptr[-1])) continue;
+		if (isident(ptr[len])) continue;
+		return ptr;
 	}
 	return NULL;
 }
 
-static int isident(int c) {
-	return isalnum(c) || c == '_';
+static struct Tag {
+	char *tag;
+	int num;
+	char *str;
+	size_t len;
+	size_t next;
+	bool used;
+} *tags;
+static size_t tagsLen, tagsCap;
+
+static void parse(char *buf, const char *name) {
+	char *line = buf;
+	char *tag = strsep(&line, "\t");
+	char *file = strsep(&line, "\t");
+	char *def = strsep(&line, "\n");
+	if (!tag || !file || !def) errx(1, "malformed tags file");
+
+	if (strcmp(file, name)) return;
+	if (tagsLen == tagsCap) {
+		tagsCap = (tagsCap ? tagsCap * 2 : 256);
+		tags = realloc(tags, tagsCap * sizeof(*tags));
+		if (!tags) err(1, "realloc");
+	}
+	struct Tag *new = &tags[tagsLen];
+	new->tag = strdup(tag);
+	if (!new->tag) err(1, "strdup");
+
+	new->num = 0;
+	new->next = 0;
+	new->used = false;
+	if (def[0] == '/' || def[0] == '?') {
+		def++;
+		def[strlen(def)-1] = '\0';
+		if (def[0] != '^') {
+			warnx("unanchored regex for tag %s: %s", tag, def);
+		}
+		new->str = deregex(def);
+		new->len = strlen(new->str);
+	} else {
+		new->num = strtol(def, &def, 10);
+		if (*def) {
+			warnx("invalid line number for tag %s: %s", tag, def);
+			return;
+		}
+	}
+	tagsLen++;
+}
+
+// The index lists the byte ranges of each file's tags, sorted by file name,
+// after a header recording the size and modification time of the tags file.
+// The header identifies the tags file by size, inode and modification time
+// to the nanosecond.
+#define INDEX_HEADER "!_HTAGML_INDEX\t%jd\t%ju\t%jd.%ld\n"
+
+static struct Run {
+	char *file;
+	off_t offset;
+	off_t length;
+} *runs;
+
+static int runCompar(const void *_a, const void *_b) {
+	const struct Run *a = _a, *b = _b;
+	int cmp = strcmp(a->file, b->file);
+	if (cmp) return cmp;
+	return (a->offset > b->offset) - (a->offset < b->offset);
+}
+
+static void writeIndex(const char *tagsPath) {
+	FILE *tagsFile = fopen(tagsPath, "r");
+	if (!tagsFile) err(1, "%s", tagsPath);
+	struct stat st;
+	int error = fstat(fileno(tagsFile), &st);
+	if (error) err(1, "%s", tagsPath);
+
+	size_t len = 0;
+	size_t cap = 0;
+	off_t offset = 0;
+	char *buf = NULL;
+	size_t bufCap = 0;
+	for (ssize_t n; 0 < (n = getline(&buf, &bufCap, tagsFile)); offset += n) {
+		char *line = buf;
+		strsep(&line, "\t");
+		char *file = strsep(&line, "\t");
+		if (!file || !line) errx(1, "malformed tags file");
+		if (len && !strcmp(runs[len-1].file, file)) {
+			runs[len-1].length += n;
+			continue;
+		}
+		if (len == cap) {
+			cap = (cap ? cap * 2 : 256);
+			runs = realloc(runs, cap * sizeof(*runs));
+			if (!runs) err(1, "realloc");
+		}
+		runs[len].file = strdup(file);
+		if (!runs[len].file) err(1, "strdup");
+		runs[len].offset = offset;
+		runs[len].length = n;
+		len++;
+	}
+	if (ferror(tagsFile)) err(1, "%s", tagsPath);
+	fclose(tagsFile);
+	qsort(runs, len, sizeof(*runs), runCompar);
+
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	snprintf(path, sizeof(path), "%s.idx", tagsPath);
+	snprintf(tmp, sizeof(tmp), "%s.idx.XXXXXXXXXX", tagsPath);
+	int fd = mkstemp(tmp);
+	if (fd < 0) err(1, "%s", tmp);
+	error = fchmod(fd, 0644);
+	if (error) err(1, "%s", tmp);
+	FILE *index = fdopen(fd, "w");
+	if (!index) err(1, "%s", tmp);
+	fprintf(
+		index, INDEX_HEADER, (intmax_t)st.st_size, (uintmax_t)st.st_ino,
+		(intmax_t)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec
+	);
+	for (size_t i = 0; i < len; ++i) {
+		fprintf(
+			index, "%s\t%jd\t%jd\n",
+			runs[i].file, (intmax_t)runs[i].offset, (intmax_t)runs[i].length
+		);
+	}
+	error = fclose(index);
+	if (error) err(1, "%s", tmp);
+	error = rename(tmp, path);
+	if (error) err(1, "%s", path);
+}
+
+static int fieldCompare(const char *line, const char *end, const char *name) {
+	const char *tab = memchr(line, '\t', end - line);
+	size_t len = (tab ? tab : end) - line;
+	int cmp = strncmp(line, name, len);
+	if (cmp) return cmp;
+	return (name[len] ? -1 : 0);
+}
+
+// Loads the tags for name using the index, or returns false if the index is
+// missing or out of date.
+static bool readIndex(FILE *index, FILE *tagsFile, const char *name) {
+	if (!index) return false;
+	struct stat st, ist;
+	int error = fstat(fileno(tagsFile), &st) || fstat(fileno(index), &ist);
+	if (error) err(1, "fstat");
+	if (!ist.st_size) return false;
+
+	char *base = mmap(
+		NULL, ist.st_size, PROT_READ, MAP_SHARED, fileno(index), 0
+	);
+	if (base == MAP_FAILED) err(1, "mmap");
+	char *end = &base[ist.st_size];
+	char header[64] = "";
+	memcpy(header, base, ist.st_size < 63 ? ist.st_size : 63);
+	intmax_t size, sec;
+	uintmax_t ino;
+	long nsec;
+	if (
+		4 != sscanf(header, INDEX_HEADER, &size, &ino, &sec, &nsec) ||
+		size != st.st_size || ino != st.st_ino ||
+		sec != st.st_mtim.tv_sec || nsec != st.st_mtim.tv_nsec
+	) {
+		munmap(base, ist.st_size);
+		return false;
+	}
+
+	char *lo = memchr(base, '\n', end - base);
+	char *hi = end;
+	lo = (lo ? lo + 1 : end);
+	while (lo < hi) {
+		char *mid = lo + (hi - lo) / 2;
+		while (mid > lo && mid[-1] != '\n') mid--;
+		if (fieldCompare(mid, hi, name) < 0) {
+			char *nl = memchr(mid, '\n', hi - mid);
+			lo = (nl ? nl + 1 : hi);
+		} else {
+			hi = mid;
+		}
+	}
+
+	char *buf = NULL;
+	size_t cap = 0;
+	while (lo < end && !fieldCompare(lo, end, name)) {
+		char *ptr = memchr(lo, '\t', end - lo);
+		if (!ptr) errx(1, "malformed tags index");
+		off_t offset = strtoll(&ptr[1], &ptr, 10);
+		off_t length = strtoll(ptr, &ptr, 10);
+		if (*ptr != '\n' || offset < 0 || length < 0) {
+			errx(1, "malformed tags index");
+		}
+		lo = &ptr[1];
+		if ((size_t)length >= cap) {
+			cap = length + 1;
+			buf = realloc(buf, cap);
+			if (!buf) err(1, "realloc");
+		}
+		if (pread(fileno(tagsFile), buf, length, offset) != length) {
+			err(1, "pread");
+		}
+		buf[length] = '\0';
+		for (char *line = buf, *nl; *line; line = &nl[1]) {
+			nl = strchr(line, '\n');
+			if (!nl) errx(1, "malformed tags file");
+			nl[0] = '\0';
+			parse(line, name);
+		}
+	}
+	free(buf);
+	munmap(base, ist.st_size);
+	return true;
+}
+
+static int compar(const void *_a, const void *_b) {
+	const size_t *a = _a, *b = _b;
+	if (tags[*a].num != tags[*b].num) return tags[*a].num - tags[*b].num;
+	return (*a > *b) - (*a < *b);
+}
+
+// Patterns are indexed in a trie, each node listing the tags whose pattern
+// ends there in order, so that a line is matched in time proportional to
+// its length.
+static struct Node {
+	char ch;
+	size_t child;
+	size_t next;
+	size_t tags;
+} *nodes;
+static size_t nodesLen, nodesCap;
+
+static size_t insert(const char *str) {
+	size_t node = 0;
+	for (; *str; ++str) {
+		size_t child = nodes[node].child;
+		while (child && nodes[child].ch != *str) child = nodes[child].next;
+		if (!child) {
+			if (nodesLen == nodesCap) {
+				nodes = realloc(nodes, (nodesCap *= 2) * sizeof(*nodes));
+				if (!nodes) err(1, "realloc");
+			}
+			child = nodesLen++;
+			nodes[child] = (struct Node) {
+				.ch = *str,
+				.next = nodes[node].child,
+			};
+			nodes[node].child = child;
+		}
+		node = child;
+	}
+	return node;
+}
+
+// Returns the first unused tag for a list, or SIZE_MAX.
+static size_t unused(size_t *list) {
+	while (*list && tags[*list - 1].used) *list = tags[*list - 1].next;
+	return (*list ? *list - 1 : SIZE_MAX);
 }
 
 int main(int argc, char *argv[]) {
@@ -85,9 +356,11 @@ int main(int argc, char *argv[]) {
 	bool pipe = false;
 	bool main = false;
 	bool index = false;
+	bool writeIdx = false;
 	const char *tagsPath = "tags";
-	for (int opt; 0 < (opt = getopt(argc, argv, "f:impx"));) {
+	for (int opt; 0 < (opt = getopt(argc, argv, "If:impx"));) {
 		switch (opt) {
+			break; case 'I': writeIdx = true;
 			break; case 'f': tagsPath = optarg;
 			break; case 'i': pipe = true;
 			break; case 'm': main = true;
@@ -96,6 +369,10 @@ int main(int argc, char *argv[]) {
 			break; default:  return 1;
 		}
 	}
+	if (writeIdx) {
+		writeIndex(tagsPath);
+		return 0;
+	}
 	if (optind == argc) errx(1, "name required");
 	const char *name = argv[optind];
 
@@ -105,72 +382,70 @@ int main(int argc, char *argv[]) {
 	FILE *tagsFile = fopen(tagsPath, "r");
 	if (!tagsFile) err(1, "%s", tagsPath);
 
+	char indexPath[PATH_MAX];
+	snprintf(indexPath, sizeof(indexPath), "%s.idx", tagsPath);
+	FILE *indexFile = fopen(indexPath, "r");
+
 #ifdef __OpenBSD__
 	int error = pledge("stdio", NULL);
 	if (error) err(1, "pledge");
 #endif
 
-	size_t len = 0;
-	size_t cap = 256;
-	struct Tag {
-		char *tag;
-		int num;
-		char *str;
-		size_t len;
-	} *tags = malloc(cap * sizeof(*tags));
-	if (!tags) err(1, "malloc");
-
 	char *buf = NULL;
 	size_t bufCap = 0;
-	while (0 < getline(&buf, &bufCap, tagsFile)) {
-		char *line = buf;
-		char *tag = strsep(&line, "\t");
-		char *file = strsep(&line, "\t");
-		char *def = strsep(&line, "\n");
-		if (!tag || !file || !def) errx(1, "malformed tags file");
-
-		if (strcmp(file, name)) continue;
-		if (len == cap) {
-			tags = realloc(tags, (cap *= 2) * sizeof(*tags));
-			if (!tags) err(1, "realloc");
-		}
-		tags[len].tag = strdup(tag);
-		if (!tags[len].tag) err(1, "strdup");
-
-		tags[len].num = 0;
-		if (def[0] == '/' || def[0] == '?') {
-			def++;
-			def[strlen(def)-1] = '\0';
-			if (def[0] != '^') {
-				warnx("unanchored regex for tag %s: %s", tag, def);
-			}
-			tags[len].str = deregex(def);
-			tags[len].len = strlen(tags[len].str);
-		} else {
-			tags[len].num = strtol(def, &def, 10);
-			if (*def) {
-				warnx("invalid line number for tag %s: %s", tag, def);
-				continue;
-			}
+	if (!readIndex(indexFile, tagsFile, name)) {
+		while (0 < getline(&buf, &bufCap, tagsFile)) {
+			parse(buf, name);
 		}
-		len++;
 	}
+	if (indexFile) fclose(indexFile);
 	fclose(tagsFile);
+	size_t len = tagsLen;
+
+	nodesLen = 1;
+	nodesCap = 256;
+	nodes = calloc(nodesCap, sizeof(*nodes));
+	if (!nodes) err(1, "calloc");
+	size_t nums = 0;
+	size_t numsLen = 0;
+	size_t *order = malloc((len ? len : 1) * sizeof(*order));
+	if (!order) err(1, "malloc");
+	for (size_t i = len - 1; i < len; --i) {
+		if (tags[i].num) {
+			order[numsLen++] = i;
+			continue;
+		}
+		size_t node = insert(tags[i].str);
+		tags[i].next = nodes[node].tags;
+		nodes[node].tags = i + 1;
+	}
+	qsort(order, numsLen, sizeof(*order), compar);
 
 	int num = 0;
 	printf(pre ? "<pre>" : index ? "<ul class=\"index\">\n" : "");
 	while (0 < getline(&buf, &bufCap, file) && ++num) {
-		char *tag = NULL;
-		for (size_t i = 0; i < len; ++i) {
-			if (tags[i].num) {
-				if (num != tags[i].num) continue;
-			} else {
-				if (strncmp(tags[i].str, buf, tags[i].len)) continue;
-			}
-			tag = tags[i].tag;
-			tags[i] = tags[--len];
+		size_t found = SIZE_MAX;
+		while (nums < numsLen && tags[order[nums]].num < num) nums++;
+		for (size_t i = nums; i < numsLen; ++i) {
+			if (tags[order[i]].num != num) break;
+			if (tags[order[i]].used) continue;
+			found = order[i];
 			break;
 		}
+		for (size_t node = 0, i = 0;; ++i) {
+			size_t first = unused(&nodes[node].tags);
+			if (first < found) found = first;
+			if (!buf[i]) break;
+			for (node = nodes[node].child; node; node = nodes[node].next) {
+				if (nodes[node].ch == buf[i]) break;
+			}
+			if (!node) break;
+		}
+		char *tag = NULL;
+		if (found != SIZE_MAX) {
+			tag = tags[found].tag;
+			tags[found].used = true;
+		}
 		if (index) {
 			if (!tag) continue;
 			printf("<li><a class=\"tag\" href=\"#");
@@ -192,16 +467,10 @@ int main(int argc, char *argv[]) {
 		}
 
 		size_t mlen = strlen(tag);
-		char *match = (pipe ? hstrstr : strstr)(buf, tag);
-		while (
-			match &&
-			((match > buf && isident(match[-1])) || isident(match[mlen]))
-		) {
-			match = (pipe ? hstrstr : strstr)(&match[mlen], tag);
-		}
+		char *match = find(buf, tag, pipe);
 		if (!match && tag[0] == 'M') {
 			mlen = 4;
-			match = (pipe ? hstrstr : strstr)(buf, "main");
+			match = find(buf, "main", pipe);
 			if (main) tag = "main";
 		}
 		if (!match) {
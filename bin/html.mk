@@ -15,10 +15,9 @@ install-html: ${HTMLS}
 
 ${HTMLS}: html.sh scheme hilex htagml htmltags
 
-htmltags: *.[chly] mtags Makefile html.mk *.sh
-	rm -f $@
-	for f in *.[chly]; do ctags -aw -f $@ $$f; done
-	./mtags -a -f $@ Makefile html.mk *.sh
+htmltags: *.[chly] htagml mtags Makefile html.mk *.sh
+	./mtags -u -f $@ *.[chly] Makefile html.mk *.sh
+	./htagml -I -f $@
 
 index.html: README.7 Makefile html.mk html.sh
 	sh html.sh README.7 Makefile html.mk html.sh > $@
@@ -16,13 +16,21 @@
 
 #include <assert.h>
 #include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <regex.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include "hilex.h"
+
 static void escape(FILE *file, const char *str, size_t len) {
 	for (size_t i = 0; i < len; ++i) {
 		if (str[i] == '\\' || str[i] == '/') {
@@ -32,30 +40,371 @@ static void escape(FILE *file, const char *str, size_t len) {
 	}
 }
 
+static regex_t cFile;
+static regex_t makeFile, makeLine;
+static regex_t mdocFile, mdocLine;
+static regex_t shFile, shLine;
+
+// Cheap checks which reject most lines before running the regex.
+static bool candidate(const regex_t *regex, const char *line, size_t len) {
+	if (regex == &makeLine) return memchr(line, ':', len);
+	if (regex == &mdocLine) return len > 2 && line[0] == '.' && line[1] == 'S';
+	if (regex == &shLine) return memchr(line, '(', len);
+	return true;
+}
+
+// The C lexer is not reentrant, so only one thread can use it at a time.
+static pthread_mutex_t lexMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void tagLex(FILE *tags, const char *path, char *map, size_t size) {
+	FILE *file = fmemopen(map, size, "r");
+	if (!file) err(1, "fmemopen");
+
+	pthread_mutex_lock(&lexMutex);
+	*LexC.in = file;
+	LexC.restore(0);
+	tokenize(&LexC);
+	tagC();
+
+	size_t offset = 0;
+	for (size_t i = 0; i < tokensLen; offset += strlen(tokens[i++].text)) {
+		if (!tokens[i].tag) continue;
+		size_t bol = offset, eol = offset;
+		while (bol && map[bol-1] != '\n') bol--;
+		while (eol < size && map[eol] != '\n') eol++;
+		fprintf(tags, "%s\t%s\t/^", tokens[i].tag, path);
+		escape(tags, &map[bol], eol - bol);
+		fprintf(tags, "$/\n");
+	}
+	untokenize();
+	pthread_mutex_unlock(&lexMutex);
+	fclose(file);
+}
+
+static void tag(FILE *tags, const char *path) {
+	const regex_t *regex;
+	if (!regexec(&cFile, path, 0, NULL, 0)) {
+		regex = &cFile;
+	} else if (!regexec(&makeFile, path, 0, NULL, 0)) {
+		regex = &makeLine;
+	} else if (!regexec(&mdocFile, path, 0, NULL, 0)) {
+		regex = &mdocLine;
+	} else if (!regexec(&shFile, path, 0, NULL, 0)) {
+		regex = &shLine;
+	} else {
+		warnx("skipping unknown file type %s", path);
+		return;
+	}
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) err(1, "%s", path);
+	struct stat st;
+	int error = fstat(fd, &st);
+	if (error) err(1, "%s", path);
+	if (!st.st_size) {
+		close(fd);
+		return;
+	}
+	char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) err(1, "%s", path);
+	close(fd);
+
+	if (regex == &cFile) {
+		tagLex(tags, path, map, st.st_size);
+		munmap(map, st.st_size);
+		return;
+	}
+
+	size_t cap = 0;
+	char *buf = NULL;
+	const char *end = &map[st.st_size];
+	for (const char *line = map, *nl; line < end; line = &nl[1]) {
+		nl = memchr(line, '\n', end - line);
+		if (!nl) nl = end;
+		size_t len = nl - line;
+		if (!candidate(regex, line, len)) continue;
+
+		if (len + 1 > cap) {
+			cap = len + 1;
+			buf = realloc(buf, cap);
+			if (!buf) err(1, "realloc");
+		}
+		memcpy(buf, line, len);
+		buf[len] = '\0';
+
+		regmatch_t match[2];
+		if (regexec(regex, buf, 2, match, 0)) continue;
+		fprintf(
+			tags, "%.*s\t%s\t/^",
+			(int)(match[1].rm_eo - match[1].rm_so), &buf[match[1].rm_so],
+			path
+		);
+		escape(tags, buf, match[0].rm_eo);
+		fprintf(tags, "/\n");
+	}
+	free(buf);
+	munmap(map, st.st_size);
+}
+
+// Files are tagged by a pool of threads into separate buffers, which are
+// then written out in argument order.
+
+static struct {
+	pthread_mutex_t mutex;
+	size_t next;
+	size_t len;
+	char **paths;
+	char **bufs;
+} work = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static void *worker(void *arg) {
+	(void)arg;
+	for (;;) {
+		pthread_mutex_lock(&work.mutex);
+		size_t i = work.next++;
+		pthread_mutex_unlock(&work.mutex);
+		if (i >= work.len) return NULL;
+		if (!work.paths[i]) continue;
+		size_t len;
+		FILE *file = open_memstream(&work.bufs[i], &len);
+		if (!file) err(1, "open_memstream");
+		tag(file, work.paths[i]);
+		int error = fclose(file);
+		if (error) err(1, "open_memstream");
+	}
+}
+
+static size_t jobs = 1;
+
+static void tagFiles(size_t len, char *paths[], char *bufs[]) {
+	work.next = 0;
+	work.len = len;
+	work.paths = paths;
+	work.bufs = bufs;
+	for (size_t i = 0; i < len; ++i) {
+		bufs[i] = NULL;
+	}
+	if (jobs > len) jobs = (len ? len : 1);
+	pthread_t threads[jobs];
+	for (size_t i = 1; i < jobs; ++i) {
+		int error = pthread_create(&threads[i], NULL, worker, NULL);
+		if (error) errx(1, "pthread_create: %s", strerror(error));
+	}
+	worker(NULL);
+	for (size_t i = 1; i < jobs; ++i) {
+		int error = pthread_join(threads[i], NULL);
+		if (error) errx(1, "pthread_join: %s", strerror(error));
+	}
+}
+
+// Updating keeps the modification time and size of each tagged file in a
+// sidecar file, and only tags the files which have changed since. Entries
+// for other files are kept, and the output is sorted by tag name.
+
+struct Stamp {
+	char *file;
+	intmax_t sec;
+	long nsec;
+	intmax_t size;
+	bool fresh;
+};
+
+static int stampCompar(const void *_a, const void *_b) {
+	const struct Stamp *a = _a, *b = _b;
+	return strcmp(a->file, b->file);
+}
+
+static struct Stamp *find(struct Stamp *stamps, size_t len, char *file) {
+	return bsearch(
+		&(struct Stamp) { .file = file },
+		stamps, len, sizeof(*stamps), stampCompar
+	);
+}
+
+static char **entries;
+static size_t entriesLen, entriesCap;
+
+static void pushEntry(char *line) {
+	if (entriesLen == entriesCap) {
+		entriesCap = (entriesCap ? entriesCap * 2 : 1024);
+		entries = realloc(entries, entriesCap * sizeof(*entries));
+		if (!entries) err(1, "realloc");
+	}
+	entries[entriesLen++] = line;
+}
+
+// Lines compare by tag name first, since the tab sorts before any
+// character of a name.
+static int entryCompar(const void *_a, const void *_b) {
+	char *const *a = _a, *const *b = _b;
+	return strcmp(*a, *b);
+}
+
+static FILE *tmpOpen(char *tmp, size_t cap, const char *path) {
+	snprintf(tmp, cap, "%s.XXXXXXXXXX", path);
+	int fd = mkstemp(tmp);
+	if (fd < 0) err(1, "%s", tmp);
+	int error = fchmod(fd, 0644);
+	if (error) err(1, "%s", tmp);
+	FILE *file = fdopen(fd, "w");
+	if (!file) err(1, "%s", tmp);
+	return file;
+}
+
+static void tmpCommit(FILE *file, const char *tmp, const char *path) {
+	int error = fclose(file);
+	if (error) err(1, "%s", tmp);
+	error = rename(tmp, path);
+	if (error) err(1, "%s", path);
+}
+
+static void update(const char *path, int argc, char *argv[]) {
+	char stampPath[PATH_MAX];
+	snprintf(stampPath, sizeof(stampPath), "%s.stamp", path);
+
+	struct Stamp *olds = NULL;
+	size_t oldsLen = 0, oldsCap = 0;
+	char *buf = NULL;
+	size_t cap = 0;
+	FILE *file = fopen(stampPath, "r");
+	while (file && 0 < getline(&buf, &cap, file)) {
+		char *line = buf;
+		struct Stamp old = { .file = strsep(&line, "\t") };
+		if (
+			!line ||
+			3 != sscanf(line, "%jd.%ld\t%jd", &old.sec, &old.nsec, &old.size)
+		) {
+			errx(1, "%s: malformed stamp", stampPath);
+		}
+		old.file = strdup(old.file);
+		if (!old.file) err(1, "strdup");
+		if (oldsLen == oldsCap) {
+			oldsCap = (oldsCap ? oldsCap * 2 : 64);
+			olds = realloc(olds, oldsCap * sizeof(*olds));
+			if (!olds) err(1, "realloc");
+		}
+		olds[oldsLen++] = old;
+	}
+	if (file) fclose(file);
+	qsort(olds, oldsLen, sizeof(*olds), stampCompar);
+
+	struct Stamp *news = calloc(argc, sizeof(*news));
+	if (!news && argc) err(1, "calloc");
+	for (int i = 0; i < argc; ++i) {
+		struct stat st;
+		int error = stat(argv[i], &st);
+		if (error) err(1, "%s", argv[i]);
+		news[i] = (struct Stamp) {
+			.file = argv[i],
+			.sec = st.st_mtim.tv_sec,
+			.nsec = st.st_mtim.tv_nsec,
+			.size = st.st_size,
+		};
+		struct Stamp *old = find(olds, oldsLen, argv[i]);
+		news[i].fresh = old
+			&& old->sec == news[i].sec
+			&& old->nsec == news[i].nsec
+			&& old->size == news[i].size;
+	}
+	qsort(news, argc, sizeof(*news), stampCompar);
+
+	// Keep old entries for unchanged files and for files not tagged here.
+	file = fopen(path, "r");
+	while (file && 0 < getline(&buf, &cap, file)) {
+		char *tab = strchr(buf, '\t');
+		if (!tab) errx(1, "malformed tags line: %s", buf);
+		char *name = &tab[1];
+		char *end = &name[strcspn(name, "\t\n")];
+		char save = *end;
+		*end = '\0';
+		struct Stamp *named = find(news, argc, name);
+		bool keep = (named ? named->fresh : !find(olds, oldsLen, name));
+		*end = save;
+		if (!keep) continue;
+		char *line = strdup(buf);
+		if (!line) err(1, "strdup");
+		pushEntry(line);
+	}
+	if (file) fclose(file);
+	free(buf);
+
+	char *paths[argc];
+	char *bufs[argc];
+	for (int i = 0; i < argc; ++i) {
+		paths[i] = (news[i].fresh ? NULL : news[i].file);
+	}
+	tagFiles(argc, paths, bufs);
+	for (int i = 0; i < argc; ++i) {
+		if (!bufs[i]) continue;
+		for (char *line = bufs[i], *nl; *line; line = &nl[1]) {
+			nl = strchr(line, '\n');
+			char *dup = strndup(line, &nl[1] - line);
+			if (!dup) err(1, "strndup");
+			pushEntry(dup);
+		}
+		free(bufs[i]);
+	}
+	qsort(entries, entriesLen, sizeof(*entries), entryCompar);
+
+	char tmp[PATH_MAX];
+	file = tmpOpen(tmp, sizeof(tmp), path);
+	for (size_t i = 0; i < entriesLen; ++i) {
+		fprintf(file, "%s", entries[i]);
+	}
+	tmpCommit(file, tmp, path);
+
+	// Stamps for files which are no longer tagged are dropped.
+	file = tmpOpen(tmp, sizeof(tmp), stampPath);
+	for (int i = 0; i < argc; ++i) {
+		fprintf(
+			file, "%s\t%jd.%09ld\t%jd\n",
+			news[i].file, news[i].sec, news[i].nsec, news[i].size
+		);
+	}
+	tmpCommit(file, tmp, stampPath);
+	for (size_t i = 0; i < oldsLen; ++i) {
+		free(olds[i].file);
+	}
+	free(olds);
+	free(news);
+}
+
 int main(int argc, char *argv[]) {
 	int error;
 	bool append = false;
+	bool incremental = false;
 	const char *path = "tags";
-	for (int opt; 0 < (opt = getopt(argc, argv, "af:"));) {
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu > 0) jobs = ncpu;
+	for (int opt; 0 < (opt = getopt(argc, argv, "af:j:u"));) {
 		switch (opt) {
 			break; case 'a': append = true;
 			break; case 'f': path = optarg;
+			break; case 'j': jobs = strtoul(optarg, NULL, 10);
+			break; case 'u': incremental = true;
 			break; default:  return 1;
 		}
 	}
 
-	FILE *tags = fopen(path, (append ? "a" : "w"));
-	if (!tags) err(1, "%s", path);
+	if (!jobs) errx(1, "invalid jobs count");
+
+	FILE *tags = NULL;
+	if (!incremental) {
+		tags = fopen(path, (append ? "a" : "w"));
+		if (!tags) err(1, "%s", path);
+	}
 
 #ifdef __OpenBSD__
-	error = pledge("stdio rpath", NULL);
+	if (incremental) {
+		error = pledge("stdio rpath wpath cpath fattr", NULL);
+	} else {
+		error = pledge("stdio rpath", NULL);
+	}
 	if (error) err(1, "pledge");
 #endif
 
-	regex_t makeFile, makeLine;
-	regex_t mdocFile, mdocLine;
-	regex_t shFile, shLine;
 	error = 0
+		|| regcomp(&cFile, "[.][chly]$", REG_EXTENDED | REG_NOSUB)
 		|| regcomp(&makeFile, "(^|/)Makefile|[.]mk$", REG_EXTENDED | REG_NOSUB)
 		|| regcomp(
 			&makeLine,
@@ -70,35 +419,15 @@ int main(int argc, char *argv[]) {
 		|| regcomp(&shLine, "^([_[:alnum:]]+)[[:blank:]]*[(][)]", REG_EXTENDED);
 	assert(!error);
 
-	size_t cap = 0;
-	char *buf = NULL;
-	for (int i = optind; i < argc; ++i) {
-		const regex_t *regex;
-		if (!regexec(&makeFile, argv[i], 0, NULL, 0)) {
-			regex = &makeLine;
-		} else if (!regexec(&mdocFile, argv[i], 0, NULL, 0)) {
-			regex = &mdocLine;
-		} else if (!regexec(&shFile, argv[i], 0, NULL, 0)) {
-			regex = &shLine;
-		} else {
-			warnx("skipping unknown file type %s", argv[i]);
-			continue;
-		}
-
-		FILE *file = fopen(argv[i], "r");
-		if (!file) err(1, "%s", argv[i]);
-
-		while (0 < getline(&buf, &cap, file)) {
-			regmatch_t match[2];
-			if (regexec(regex, buf, 2, match, 0)) continue;
-			fprintf(
-				tags, "%.*s\t%s\t/^",
-				(int)(match[1].rm_eo - match[1].rm_so), &buf[match[1].rm_so],
-				argv[i]
-			);
-			escape(tags, buf, match[0].rm_eo);
-			fprintf(tags, "/\n");
-		}
-		fclose(file);
+	if (incremental) {
+		update(path, argc - optind, &argv[optind]);
+		return 0;
+	}
+	char *bufs[argc - optind];
+	tagFiles(argc - optind, &argv[optind], bufs);
+	for (int i = 0; i < argc - optind; ++i) {
+		if (bufs[i]) fprintf(tags, "%s", bufs[i]);
 	}
+	error = fclose(tags);
+	if (error) err(1, "%s", path);
 }
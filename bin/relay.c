@@ -26,15 +26,21 @@
  */
 
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
 #include <tls.h>
 #include <unistd.h>
 
@@ -42,27 +48,161 @@
 #include <sys/capsicum.h>
 #endif
 
-static void clientWrite(struct tls *client, const char *ptr, size_t len) {
+static struct tls_config *config;
+static struct tls *client;
+static int sock = -1;
+static bool registered;
+
+// Output is queued and written as the socket allows, so a slow server
+// does not block reading input.
+enum { QueueCap = 64 * 1024 };
+struct Queue {
+	char buf[QueueCap];
+	size_t head;
+	size_t len;
+	size_t total;
+};
+static struct Queue queue;
+
+static bool queuePush(struct Queue *q, const char *ptr, size_t len) {
+	if (len > QueueCap - q->len) return false;
 	while (len) {
-		ssize_t ret = tls_write(client, ptr, len);
-		if (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT) continue;
-		if (ret < 0) errx(1, "tls_write: %s", tls_error(client));
-		ptr += ret;
-		len -= ret;
+		size_t tail = (q->head + q->len) % QueueCap;
+		size_t n = QueueCap - tail;
+		if (n > len) n = len;
+		memcpy(&q->buf[tail], ptr, n);
+		q->len += n;
+		q->total += n;
+		ptr += n;
+		len -= n;
 	}
+	return true;
 }
 
-static void clientFormat(struct tls *client, const char *format, ...) {
+static void queueShift(struct Queue *q, size_t len) {
+	q->head = (q->head + len) % QueueCap;
+	q->len -= len;
+}
+
+// Buffered output is discarded, but backlog lines stay in the backlog
+// until written, so they are sent again after reconnecting.
+static void clientClose(void) {
+	tls_close(client);
+	tls_free(client);
+	client = NULL;
+	close(sock);
+	sock = -1;
+	registered = false;
+	queue.head = 0;
+	queue.len = 0;
+	queue.total = 0;
+}
+
+// A server which stops reading while still sending is dropped, since
+// its replies would have nowhere to go.
+static void clientWrite(const char *ptr, size_t len) {
+	if (sock < 0) return;
+	if (!queuePush(&queue, ptr, len)) {
+		warnx("output queue full");
+		clientClose();
+	}
+}
+
+// Returns the poll event needed to continue writing, or 0 once the queue
+// is empty.
+static short clientFlush(void) {
+	while (queue.len) {
+		size_t n = QueueCap - queue.head;
+		if (n > queue.len) n = queue.len;
+		ssize_t ret = tls_write(client, &queue.buf[queue.head], n);
+		if (ret == TLS_WANT_POLLIN) return POLLIN;
+		if (ret == TLS_WANT_POLLOUT) return POLLOUT;
+		if (ret < 0) {
+			warnx("tls_write: %s", tls_error(client));
+			clientClose();
+			return 0;
+		}
+		queueShift(&queue, ret);
+	}
+	return 0;
+}
+
+static void clientFormat(const char *format, ...) {
 	char buf[1024];
 	va_list ap;
 	va_start(ap, format);
 	int len = vsnprintf(buf, sizeof(buf), format, ap);
 	va_end(ap);
 	if ((size_t)len > sizeof(buf) - 1) errx(1, "message too large");
-	clientWrite(client, buf, len);
+	clientWrite(buf, len);
+}
+
+// Messages from channels are queued for each output, so a slow reader
+// does not block the connection. Messages are dropped while its queue is
+// full, and all output to it stops if writing fails.
+enum { InputCap = 32 };
+static struct Output {
+	int fd;
+	bool error;
+	struct Queue queue;
+} outputs[1 + InputCap] = { { .fd = STDOUT_FILENO } };
+static size_t outputsLen = 1;
+
+static void outputFormat(struct Output *out, const char *format, ...) {
+	char buf[1024];
+	va_list ap;
+	va_start(ap, format);
+	int len = vsnprintf(buf, sizeof(buf), format, ap);
+	va_end(ap);
+	if ((size_t)len > sizeof(buf) - 1) {
+		len = sizeof(buf) - 1;
+		buf[len - 1] = '\n';
+	}
+	if (!out->error) queuePush(&out->queue, buf, len);
 }
 
-static void clientHandle(struct tls *client, const char *chan, char *line) {
+static void outputFlush(struct Output *out) {
+	while (out->queue.len && !out->error) {
+		size_t n = QueueCap - out->queue.head;
+		if (n > out->queue.len) n = out->queue.len;
+		ssize_t ret = write(out->fd, &out->queue.buf[out->queue.head], n);
+		if (ret < 0 && errno == EAGAIN) return;
+		if (ret < 0) {
+			warn("write");
+			out->error = true;
+			out->queue.len = 0;
+			return;
+		}
+		queueShift(&out->queue, ret);
+	}
+}
+
+// Each input relays lines to a channel and outputs messages from it.
+// Lines longer than fit in a NOTICE to the channel are split.
+static struct Input {
+	const char *chan;
+	int fd;
+	struct Output *out;
+	char buf[512];
+	size_t len;
+	bool eof;
+} inputs[InputCap];
+static size_t inputsLen;
+
+static struct Input *inputChan(const char *chan) {
+	for (size_t i = 0; i < inputsLen; ++i) {
+		if (!strcmp(inputs[i].chan, chan)) return &inputs[i];
+	}
+	return NULL;
+}
+
+static void clientJoin(void) {
+	for (size_t i = 0; i < inputsLen; ++i) {
+		clientFormat("JOIN :%s\r\n", inputs[i].chan);
+	}
+}
+
+static void clientHandle(char *line) {
 	char *prefix = NULL;
 	if (line[0] == ':') {
 		prefix = strsep(&line, " ") + 1;
@@ -71,9 +211,10 @@ static void clientHandle(struct tls *client, const char *chan, char *line) {
 
 	char *command = strsep(&line, " ");
 	if (!strcmp(command, "001") || !strcmp(command, "INVITE")) {
-		clientFormat(client, "JOIN :%s\r\n", chan);
+		registered = true;
+		clientJoin();
 	} else if (!strcmp(command, "PING")) {
-		clientFormat(client, "PONG %s\r\n", line);
+		clientFormat("PONG %s\r\n", line);
 	}
 	if (strcmp(command, "PRIVMSG") && strcmp(command, "NOTICE")) return;
 
@@ -81,8 +222,9 @@ static void clientHandle(struct tls *client, const char *chan, char *line) {
 	char *nick = strsep(&prefix, "!");
 
 	if (!line) errx(1, "message without destination");
-	char *dest = strsep(&line, " ");
-	if (strcmp(dest, chan)) return;
+	struct Input *input = inputChan(strsep(&line, " "));
+	if (!input) return;
+	struct Output *out = input->out;
 
 	if (!line || line[0] != ':') errx(1, "message without message");
 	line = &line[1];
@@ -90,128 +232,486 @@ static void clientHandle(struct tls *client, const char *chan, char *line) {
 	if (!strncmp(line, "\1ACTION ", 8)) {
 		line = &line[8];
 		size_t len = strcspn(line, "\1");
-		printf("* %c\u200C%s %.*s\n", nick[0], &nick[1], (int)len, line);
+		outputFormat(
+			out, "* %c\u200C%s %.*s\n", nick[0], &nick[1], (int)len, line
+		);
 	} else if (command[0] == 'N') {
-		printf("-%c\u200C%s- %s\n", nick[0], &nick[1], line);
+		outputFormat(out, "-%c\u200C%s- %s\n", nick[0], &nick[1], line);
 	} else {
-		printf("<%c\u200C%s> %s\n", nick[0], &nick[1], line);
+		outputFormat(out, "<%c\u200C%s> %s\n", nick[0], &nick[1], line);
 	}
 }
 
-#ifdef __FreeBSD__
-static void limit(int fd, const cap_rights_t *rights) {
-	int error = cap_rights_limit(fd, rights);
-	if (error) err(1, "cap_rights_limit");
+// Lines wait in the backlog to be sent as the token bucket allows, and
+// stay there once queued until the queue has written them. New lines are
+// dropped while it is full.
+enum { BacklogCap = 256 };
+static struct {
+	struct Line {
+		struct Input *input;
+		char text[sizeof(inputs[0].buf)];
+		size_t end;
+		bool coalesced;
+	} lines[BacklogCap];
+	size_t head;
+	size_t len;
+	size_t queued;
+	size_t sent;
+	size_t coalesced;
+	size_t dropped;
+} backlog;
+
+static struct Line *backlogLine(size_t i) {
+	return &backlog.lines[(backlog.head + i) % BacklogCap];
 }
-#endif
 
-int main(int argc, char *argv[]) {
-	int error;
+static void backlogPush(struct Input *input, const char *line, size_t len) {
+	if (backlog.len == BacklogCap) {
+		backlog.dropped++;
+		return;
+	}
+	struct Line *dst = backlogLine(backlog.len++);
+	dst->input = input;
+	memcpy(dst->text, line, len);
+	dst->text[len] = '\0';
+}
 
-	if (argc < 5) return 1;
-	const char *host = argv[1];
-	const char *port = argv[2];
-	const char *nick = argv[3];
-	const char *chan = argv[4];
+static size_t lineMax(const char *chan) {
+	return 510 - strlen("NOTICE  :") - strlen(chan);
+}
 
-	setlinebuf(stdout);
-	signal(SIGPIPE, SIG_IGN);
+static void inputLines(struct Input *input) {
+	size_t max = lineMax(input->chan);
+	char *line = input->buf;
+	char *end = &input->buf[input->len];
+	while (line < end) {
+		size_t len = end - line;
+		char *nl = memchr(line, '\n', (len > max ? max + 1 : len));
+		if (nl) {
+			backlogPush(input, line, nl - line);
+			line = &nl[1];
+		} else if (len >= max) {
+			backlogPush(input, line, max);
+			line = &line[max];
+		} else if (input->eof) {
+			backlogPush(input, line, len);
+			line = end;
+		} else {
+			break;
+		}
+	}
+	input->len = end - line;
+	memmove(input->buf, line, input->len);
+}
 
-	struct tls_config *config = tls_config_new();
-	if (!config) errx(1, "tls_config_new");
+// Other status flags, such as O_APPEND on redirected output, are kept.
+static void nonblock(int fd, const char *name) {
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0) err(1, "%s", name);
+	int error = fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	if (error) err(1, "%s", name);
+}
 
-	error = tls_config_set_ciphers(config, "compat");
-	if (error) {
-		errx(1, "tls_config_set_ciphers: %s", tls_config_error(config));
+// Channels are mapped as chan:path, since channel names cannot contain
+// colons. Paths name a FIFO to read or a UNIX-domain socket to connect
+// to, which also receives the channel's messages. A chan without a path
+// maps to standard input.
+static void inputOpen(char *arg) {
+	if (inputsLen == InputCap) errx(1, "too many channels");
+	struct Input *input = &inputs[inputsLen++];
+	input->chan = strsep(&arg, ":");
+	if (strlen(input->chan) > 200) errx(1, "%s: too long", input->chan);
+	input->fd = STDIN_FILENO;
+	input->out = &outputs[0];
+	if (!arg) {
+		for (size_t i = 0; i + 1 < inputsLen; ++i) {
+			if (inputs[i].fd != STDIN_FILENO) continue;
+			errx(1, "%s: standard input already mapped", input->chan);
+		}
+		return;
 	}
 
-	struct tls *client = tls_client();
-	if (!client) errx(1, "tls_client");
+	struct stat st;
+	int error = stat(arg, &st);
+	if (error) err(1, "%s", arg);
+	if (S_ISSOCK(st.st_mode)) {
+		struct sockaddr_un addr = { .sun_family = AF_UNIX };
+		if (strlen(arg) >= sizeof(addr.sun_path)) errx(1, "%s: too long", arg);
+		strcpy(addr.sun_path, arg);
+		input->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (input->fd < 0) err(1, "socket");
+		error = connect(input->fd, (struct sockaddr *)&addr, sizeof(addr));
+		if (error) err(1, "%s", arg);
+		input->out = &outputs[outputsLen++];
+		input->out->fd = input->fd;
+	} else {
+		// Opening for writing as well keeps the FIFO from reaching EOF.
+		input->fd = open(arg, O_RDWR);
+		if (input->fd < 0) err(1, "%s", arg);
+	}
+	nonblock(input->fd, arg);
+}
 
-	error = tls_configure(client, config);
-	if (error) errx(1, "tls_configure: %s", tls_error(client));
-	tls_config_free(config);
+static long now(void) {
+	struct timespec ts;
+	int error = clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (error) err(1, "clock_gettime");
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-	struct addrinfo *head;
+// The bucket holds up to burst messages, and refills by one message each
+// interval. Its level is kept in milliseconds.
+static struct {
+	long burst;
+	long interval;
+	long level;
+	long time;
+} bucket = { .burst = 5, .interval = 2000 };
+
+static void bucketFill(void) {
+	long time = now();
+	bucket.level += time - bucket.time;
+	if (bucket.level > bucket.burst * bucket.interval) {
+		bucket.level = bucket.burst * bucket.interval;
+	}
+	bucket.time = time;
+}
+
+static bool coalesce;
+
+// Sends backlog lines as messages while the bucket and the queue allow.
+// Returns true if lines are left waiting for room in the queue.
+static bool backlogSend(void) {
+	bucketFill();
+	if (!registered) return false;
+	while (backlog.queued < backlog.len && bucket.level >= bucket.interval) {
+		if (QueueCap - queue.len < 1024) return true;
+		char buf[1024];
+		size_t first = backlog.queued;
+		struct Line *line = backlogLine(backlog.queued++);
+		line->coalesced = false;
+		const char *chan = line->input->chan;
+		size_t max = lineMax(chan);
+		size_t len = strlen(line->text);
+		memcpy(buf, line->text, len);
+		while (coalesce && backlog.queued < backlog.len) {
+			line = backlogLine(backlog.queued);
+			if (line->input->chan != chan) break;
+			size_t next = strlen(line->text);
+			if (len + 3 + next > max) break;
+			memcpy(&buf[len], " | ", 3);
+			memcpy(&buf[len + 3], line->text, next);
+			len += 3 + next;
+			line->coalesced = true;
+			backlog.queued++;
+		}
+		clientFormat("NOTICE %s :%.*s\r\n", chan, (int)len, buf);
+		for (size_t i = first; i < backlog.queued; ++i) {
+			backlogLine(i)->end = queue.total;
+		}
+		bucket.level -= bucket.interval;
+	}
+	return false;
+}
+
+// Removes lines which the queue has written from the backlog.
+static void backlogWritten(void) {
+	while (backlog.queued) {
+		struct Line *line = backlogLine(0);
+		if (line->end > queue.total - queue.len) break;
+		backlog.head = (backlog.head + 1) % BacklogCap;
+		backlog.len--;
+		backlog.queued--;
+		backlog.sent++;
+		if (line->coalesced) backlog.coalesced++;
+	}
+}
+
+// Milliseconds until the bucket allows sending the backlog, or -1.
+static int backlogWait(void) {
+	if (!registered || backlog.queued == backlog.len) return -1;
+	if (bucket.level >= bucket.interval) return -1;
+	return bucket.interval - bucket.level;
+}
+
+enum {
+	BackoffMin = 1000,
+	BackoffMax = 5 * 60 * 1000,
+};
+
+static volatile sig_atomic_t stats;
+static void signalStats(int sig) {
+	(void)sig;
+	stats = 1;
+}
+
+// Connections are made without blocking, trying each address in turn as
+// its connection fails. Failures are only warnings, since the connection
+// is retried.
+static struct addrinfo *addrs, *addr;
+static bool connecting;
+
+static void clientAttempt(void) {
+	for (; addr; addr = addr->ai_next) {
+		sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+		if (sock < 0) err(1, "socket");
+
+		nonblock(sock, "socket");
+
+		int error = connect(sock, addr->ai_addr, addr->ai_addrlen);
+		if (!error || errno == EINPROGRESS) {
+			connecting = true;
+			return;
+		}
+
+		close(sock);
+		sock = -1;
+	}
+	warn("connect");
+	freeaddrinfo(addrs);
+	addrs = NULL;
+}
+
+static void clientConnect(const char *host, const char *port) {
 	struct addrinfo hints = {
 		.ai_family = AF_UNSPEC,
 		.ai_socktype = SOCK_STREAM,
 		.ai_protocol = IPPROTO_TCP,
 	};
-	error = getaddrinfo(host, port, &hints, &head);
-	if (error) errx(1, "getaddrinfo: %s", gai_strerror(error));
-
-	int sock = -1;
-	for (struct addrinfo *ai = head; ai; ai = ai->ai_next) {
-		sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-		if (sock < 0) err(1, "socket");
-
-		error = connect(sock, ai->ai_addr, ai->ai_addrlen);
-		if (!error) break;
+	int error = getaddrinfo(host, port, &hints, &addrs);
+	if (error) {
+		warnx("getaddrinfo: %s", gai_strerror(error));
+		return;
+	}
+	addr = addrs;
+	clientAttempt();
+}
 
+// Returns true once connected and starting the TLS handshake.
+static bool clientConnected(const char *host) {
+	int error;
+	socklen_t len = sizeof(error);
+	int ret = getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &len);
+	if (ret) err(1, "getsockopt");
+	connecting = false;
+	if (error) {
 		close(sock);
 		sock = -1;
+		errno = error;
+		addr = addr->ai_next;
+		clientAttempt();
+		return false;
 	}
-	if (sock < 0) err(1, "connect");
-	freeaddrinfo(head);
+	freeaddrinfo(addrs);
+	addrs = NULL;
+
+	client = tls_client();
+	if (!client) errx(1, "tls_client");
+
+	error = tls_configure(client, config);
+	if (error) errx(1, "tls_configure: %s", tls_error(client));
 
 	error = tls_connect_socket(client, sock, host);
-	if (error) errx(1, "tls_connect: %s", tls_error(client));
+	if (error) {
+		warnx("tls_connect: %s", tls_error(client));
+		clientClose();
+		return false;
+	}
+	return true;
+}
 
 #ifdef __FreeBSD__
-	error = cap_enter();
-	if (error) err(1, "cap_enter");
+static void limit(int fd, const cap_rights_t *rights) {
+	int error = cap_rights_limit(fd, rights);
+	if (error) err(1, "cap_rights_limit");
+}
+#endif
+
+int main(int argc, char *argv[]) {
+	int error;
+
+	for (int opt; 0 < (opt = getopt(argc, argv, "b:ci:"));) {
+		switch (opt) {
+			break; case 'b': bucket.burst = strtol(optarg, NULL, 10);
+			break; case 'c': coalesce = true;
+			break; case 'i': bucket.interval = strtol(optarg, NULL, 10);
+			break; default:  return 1;
+		}
+	}
+	if (bucket.burst < 1 || bucket.interval < 0) return 1;
+	if (argc - optind < 4) return 1;
+	const char *host = argv[optind + 0];
+	const char *port = argv[optind + 1];
+	const char *nick = argv[optind + 2];
+	for (int i = optind + 3; i < argc; ++i) {
+		inputOpen(argv[i]);
+	}
 
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGUSR1, signalStats);
+#ifdef SIGINFO
+	signal(SIGINFO, signalStats);
+#endif
+	bucket.time = now();
+	bucket.level = bucket.burst * bucket.interval;
+
+	config = tls_config_new();
+	if (!config) errx(1, "tls_config_new");
+
+	error = tls_config_set_ciphers(config, "compat");
+	if (error) {
+		errx(1, "tls_config_set_ciphers: %s", tls_config_error(config));
+	}
+
+	// Sessions are saved to resume them when reconnecting.
+	FILE *session = tmpfile();
+	if (!session) err(1, "tmpfile");
+	error = tls_config_set_session_fd(config, fileno(session));
+	if (error) {
+		errx(1, "tls_config_set_session_fd: %s", tls_config_error(config));
+	}
+
+	nonblock(STDIN_FILENO, "stdin");
+	nonblock(STDOUT_FILENO, "stdout");
+
+#ifdef __FreeBSD__
 	cap_rights_t rights;
 	cap_rights_init(&rights, CAP_WRITE);
-	limit(STDOUT_FILENO, &rights);
 	limit(STDERR_FILENO, &rights);
 
+	cap_rights_init(&rights, CAP_EVENT, CAP_WRITE);
+	limit(STDOUT_FILENO, &rights);
+
 	cap_rights_init(&rights, CAP_EVENT, CAP_READ);
 	limit(STDIN_FILENO, &rights);
-
-	cap_rights_set(&rights, CAP_WRITE);
-	limit(sock, &rights);
 #endif
 
-	clientFormat(client, "NICK :%s\r\nUSER %s 0 * :%s\r\n", nick, nick, nick);
-
-	char *input = NULL;
-	size_t cap = 0;
-
 	char buf[4096];
 	size_t len = 0;
 
-	struct pollfd fds[2] = {
-		{ .events = POLLIN, .fd = STDIN_FILENO },
-		{ .events = POLLIN, .fd = sock },
-	};
-	while (0 < poll(fds, 2, -1)) {
-		if (fds[0].revents) {
-			ssize_t len = getline(&input, &cap, stdin);
-			if (len < 0) err(1, "getline");
-			input[len - 1] = '\0';
-			clientFormat(client, "NOTICE %s :%s\r\n", chan, input);
-		}
-		if (!fds[1].revents) continue;
-
-		ssize_t read = tls_read(client, &buf[len], sizeof(buf) - len);
-		if (read == TLS_WANT_POLLIN || read == TLS_WANT_POLLOUT) continue;
-		if (read < 0) errx(1, "tls_read: %s", tls_error(client));
-		if (!read) return 1;
-		len += read;
-
-		char *crlf;
-		char *line = buf;
-		for (;;) {
-			crlf = memmem(line, &buf[len] - line, "\r\n", 2);
-			if (!crlf) break;
-			crlf[0] = '\0';
-			clientHandle(client, chan, line);
-			line = &crlf[2];
-		}
-		len -= line - buf;
-		memmove(buf, line, len);
-	}
-	err(1, "poll");
+	long backoff = BackoffMin;
+	long retry = now();
+	short want = 0;
+	short wantRead = 0;
+	struct pollfd fds[1 + InputCap + 1 + InputCap];
+	for (;;) {
+		if (sock < 0 && now() >= retry) {
+			clientConnect(host, port);
+			retry = now() + backoff;
+			backoff *= 2;
+			if (backoff > BackoffMax) backoff = BackoffMax;
+			backlog.queued = 0;
+			if (sock < 0) {
+				warnx("reconnecting in %lds", (retry - now()) / 1000);
+			}
+		}
+
+		int timeout = backlogWait();
+		if (sock < 0) timeout = (retry > now() ? retry - now() : 0);
+		fds[0].fd = sock;
+		fds[0].events = (connecting ? POLLOUT : POLLIN | want | wantRead);
+		for (size_t i = 0; i < inputsLen; ++i) {
+			struct Input *input = &inputs[i];
+			fds[1 + i].fd = (input->eof ? -1 : input->fd);
+			// Inputs wait while the queue drains.
+			fds[1 + i].events = (
+				!queue.len && input->len < sizeof(input->buf) ? POLLIN : 0
+			);
+		}
+		struct pollfd *outFds = &fds[1 + inputsLen];
+		for (size_t i = 0; i < outputsLen; ++i) {
+			struct Output *out = &outputs[i];
+			outFds[i].fd = (out->queue.len ? out->fd : -1);
+			outFds[i].events = POLLOUT;
+		}
+		int nfds = poll(fds, 1 + inputsLen + outputsLen, timeout);
+		if (nfds < 0 && errno != EINTR) err(1, "poll");
+
+		if (stats) {
+			warnx(
+				"%zu queued, %zu sent, %zu coalesced, %zu dropped",
+				backlog.len, backlog.sent, backlog.coalesced, backlog.dropped
+			);
+			stats = 0;
+		}
+		if (nfds < 0) continue;
+
+		for (size_t i = 0; i < inputsLen; ++i) {
+			struct Input *input = &inputs[i];
+			if (!fds[1 + i].revents) continue;
+			ssize_t n = read(
+				input->fd, &input->buf[input->len],
+				sizeof(input->buf) - input->len
+			);
+			if (n < 0 && errno != EAGAIN) err(1, "%s", input->chan);
+			if (!n) input->eof = true;
+			if (n > 0) input->len += n;
+			inputLines(input);
+		}
+
+		if (connecting && fds[0].revents) {
+			if (clientConnected(host)) {
+				clientFormat(
+					"NICK :%s\r\nUSER %s 0 * :%s\r\n", nick, nick, nick
+				);
+				len = 0;
+				want = clientFlush();
+				wantRead = 0;
+			} else if (sock < 0) {
+				warnx("reconnecting in %lds", (retry - now()) / 1000);
+			}
+		} else if (sock >= 0 && fds[0].revents) {
+			for (wantRead = 0;;) {
+				ssize_t read = tls_read(client, &buf[len], sizeof(buf) - len);
+				if (read == TLS_WANT_POLLIN) break;
+				if (read == TLS_WANT_POLLOUT) {
+					wantRead = POLLOUT;
+					break;
+				}
+				if (read <= 0) {
+					if (read < 0) warnx("tls_read: %s", tls_error(client));
+					else warnx("disconnected");
+					clientClose();
+					break;
+				}
+				len += read;
+
+				char *crlf;
+				char *line = buf;
+				while (sock >= 0) {
+					crlf = memmem(line, &buf[len] - line, "\r\n", 2);
+					if (!crlf) break;
+					crlf[0] = '\0';
+					clientHandle(line);
+					line = &crlf[2];
+				}
+				if (sock < 0) break;
+				if (registered) backoff = BackoffMin;
+				len -= line - buf;
+				memmove(buf, line, len);
+				if (len == sizeof(buf)) errx(1, "line too long");
+			}
+		}
+
+		bool more;
+		do {
+			more = backlogSend();
+			want = (sock < 0 || connecting ? 0 : clientFlush());
+			backlogWritten();
+		} while (more && !want);
+		for (size_t i = 0; i < outputsLen; ++i) {
+			outputFlush(&outputs[i]);
+		}
+
+		if (backlog.len || queue.len) continue;
+		size_t i;
+		for (i = 0; i < outputsLen; ++i) {
+			if (outputs[i].queue.len) break;
+		}
+		if (i < outputsLen) continue;
+		for (i = 0; i < inputsLen; ++i) {
+			if (!inputs[i].eof || inputs[i].len) break;
+		}
+		if (i == inputsLen) return 1;
+	}
 }
@@ -0,0 +1,257 @@
+/* Copyright (C) 2020  June McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hilex.h"
+
+struct Token *tokens;
+size_t tokensLen;
+static size_t tokensCap;
+
+void tokenize(const struct Lexer *lexer) {
+	for (enum Class class; None != (class = lexer->lex());) {
+		assert(class < ClassCap);
+		if (tokensLen == tokensCap) {
+			tokensCap = (tokensCap ? tokensCap * 2 : 1024);
+			tokens = realloc(tokens, sizeof(*tokens) * tokensCap);
+			if (!tokens) err(1, "realloc");
+		}
+		tokens[tokensLen] = (struct Token) {
+			.class = class,
+			.text = strdup(*lexer->text),
+		};
+		if (!tokens[tokensLen++].text) err(1, "strdup");
+	}
+}
+
+// Tags are deduplicated in a hash set, open addressed by linear probing
+// and kept at most half full.
+static char **tags;
+static size_t tagsLen, tagsCap;
+
+static size_t hash(const char *str) {
+	size_t hash = 5381;
+	for (; *str; ++str) {
+		hash = hash * 33 ^ (unsigned char)*str;
+	}
+	return hash;
+}
+
+static char **tagsSlot(char **set, size_t cap, const char *tag) {
+	size_t i = hash(tag) & (cap - 1);
+	while (set[i] && strcmp(set[i], tag)) i = (i + 1) & (cap - 1);
+	return &set[i];
+}
+
+static void tagRange(size_t first, size_t last, char *tag) {
+	if (2 * (tagsLen + 1) > tagsCap) {
+		size_t cap = (tagsCap ? tagsCap * 2 : 128);
+		char **set = calloc(cap, sizeof(*set));
+		if (!set) err(1, "calloc");
+		for (size_t i = 0; i < tagsCap; ++i) {
+			if (tags[i]) *tagsSlot(set, cap, tags[i]) = tags[i];
+		}
+		free(tags);
+		tags = set;
+		tagsCap = cap;
+	}
+	char **slot = tagsSlot(tags, tagsCap, tag);
+	if (*slot) {
+		free(tag);
+		return;
+	}
+	*slot = tag;
+	tagsLen++;
+	tokens[first].tag = tag;
+	tokens[last].close = true;
+}
+
+static void tagToken(size_t i) {
+	char *tag = strdup(tokens[i].text);
+	if (!tag) err(1, "strdup");
+	tagRange(i, i, tag);
+}
+
+static bool is(size_t i, enum Class class, const char *text) {
+	return i < tokensLen
+		&& tokens[i].class == class
+		&& !strcmp(tokens[i].text, text);
+}
+
+static bool bol(size_t i) {
+	if (!i) return true;
+	const char *text = tokens[i-1].text;
+	return *text && text[strlen(text)-1] == '\n';
+}
+
+static size_t skipBlank(size_t i) {
+	for (; i < tokensLen; ++i) {
+		if (tokens[i].class == Comment) continue;
+		if (tokens[i].class != Normal) break;
+		if (tokens[i].text[strspn(tokens[i].text, " \t\n")]) break;
+	}
+	return i;
+}
+
+static size_t skipBack(size_t i) {
+	while (i-- > 0) {
+		if (tokens[i].class == Comment) continue;
+		if (tokens[i].class != Normal) break;
+		if (tokens[i].text[strspn(tokens[i].text, " \t\n")]) break;
+	}
+	return i;
+}
+
+// Whether a token can come before the name in a declaration.
+static bool typed(size_t i) {
+	if (is(i, Keyword, "struct")) return false;
+	if (is(i, Keyword, "union")) return false;
+	if (is(i, Keyword, "enum")) return false;
+	return is(i, Operator, "*")
+		|| is(i, Normal, ",")
+		|| is(i, Normal, "}")
+		|| (i < tokensLen && tokens[i].class == Ident)
+		|| (i < tokensLen && tokens[i].class == Keyword);
+}
+
+// Variables are tagged where a name at file scope is followed by an
+// initializer, array declarator or the end of its declaration. The rules
+// sections of lex and yacc sources are skipped.
+void tagC(void) {
+	size_t depth = 0, paren = 0;
+	bool declare = false, init = false;
+	bool rules = false;
+	for (size_t i = 0; i < tokensLen; ++i) {
+		const struct Token *tok = &tokens[i];
+		if (is(i, Macro, "%%")) rules ^= true;
+		if (rules) continue;
+		if (is(i, Normal, "{")) depth++;
+		if (is(i, Normal, "}") && depth) depth--;
+		if (depth) continue;
+		if (is(i, Normal, "(")) paren++;
+		if (is(i, Normal, ")") && paren) paren--;
+		if (is(i, Normal, ";")) declare = false;
+		if (is(i, Keyword, "extern") || is(i, Keyword, "typedef")) {
+			declare = true;
+		}
+		if (is(i, Normal, ";") || is(i, Normal, ",")) init = false;
+		if (is(i, Operator, "=") && !paren) init = true;
+
+		if (tok->class == Macro) {
+			const char *directive = &tok->text[strspn(tok->text, "# \t")];
+			if (strcmp(directive, "define")) {
+				continue;
+			}
+			size_t j = skipBlank(i + 1);
+			if (j < tokensLen && tokens[j].class == Macro) tagToken(j);
+
+		} else if (tok->class == Keyword && !strcmp(tok->text, "typedef")) {
+			size_t name = 0;
+			for (size_t j = i + 1, parens = 0, braces = 0; j < tokensLen; ++j) {
+				if (is(j, Normal, "(")) parens++;
+				if (is(j, Normal, ")") && parens) parens--;
+				if (is(j, Normal, "{")) braces++;
+				if (is(j, Normal, "}") && braces) braces--;
+				if (parens || braces) continue;
+				if (tokens[j].class == Ident) name = j;
+				if (is(j, Normal, ";")) break;
+			}
+			if (name) tagToken(name);
+
+		} else if (
+			is(i, Keyword, "struct") ||
+			is(i, Keyword, "union") ||
+			is(i, Keyword, "enum")
+		) {
+			size_t j = skipBlank(i + 1);
+			if (j == tokensLen || tokens[j].class != Ident) continue;
+			if (is(skipBlank(j + 1), Normal, "{")) tagToken(j);
+
+		} else if (tok->class == Ident && is(skipBlank(i + 1), Normal, "(")) {
+			size_t j = skipBlank(i + 1);
+			for (size_t parens = 0; j < tokensLen; ++j) {
+				if (is(j, Normal, "(")) parens++;
+				if (is(j, Normal, ")") && !--parens) break;
+			}
+			if (is(skipBlank(j + 1), Normal, "{")) tagToken(i);
+
+		} else if (tok->class == Ident && !paren && !declare && !init) {
+			size_t k = skipBack(i);
+			if (!typed(k)) continue;
+			size_t j = skipBlank(i + 1);
+			if (
+				is(j, Operator, "=") || is(j, Operator, "[") ||
+				is(j, Normal, ";") || is(j, Normal, ",")
+			) tagToken(i);
+		}
+	}
+}
+
+void tagMake(void) {
+	for (size_t i = 0; i + 1 < tokensLen; ++i) {
+		if (tokens[i].class != Ident || !bol(i)) continue;
+		const struct Token *op = &tokens[i+1];
+		if (op->class != Operator || !strchr(":!", op->text[0])) continue;
+		if (!strchr(op->text, '=')) tagToken(i);
+	}
+}
+
+void tagMdoc(void) {
+	for (size_t i = 0; i + 2 < tokensLen; ++i) {
+		if (!is(i, Keyword, ".") || !bol(i)) continue;
+		if (!is(i+1, Keyword, "Sh") && !is(i+1, Keyword, "Ss")) continue;
+		size_t first = i + 2;
+		while (is(first, Normal, " ")) first++;
+		size_t last = first;
+		while (last < tokensLen && !strchr(tokens[last].text, '\n')) last++;
+		if (last-- == first) continue;
+
+		char *tag = NULL;
+		size_t len = 0;
+		FILE *file = open_memstream(&tag, &len);
+		if (!file) err(1, "open_memstream");
+		for (size_t j = first; j <= last; ++j) {
+			fprintf(file, "%s", tokens[j].text);
+		}
+		int error = fclose(file);
+		if (error) err(1, "open_memstream");
+		tagRange(first, last, tag);
+	}
+}
+
+void tagSh(void) {
+	for (size_t i = 0; i < tokensLen; ++i) {
+		if (tokens[i].class != Ident || !bol(i)) continue;
+		if (is(skipBlank(i + 1), Normal, "(")) tagToken(i);
+	}
+}
+
+void untokenize(void) {
+	for (size_t i = 0; i < tagsCap; ++i) {
+		free(tags[i]);
+		tags[i] = NULL;
+	}
+	for (size_t i = 0; i < tokensLen; ++i) {
+		free(tokens[i].text);
+	}
+	tagsLen = 0;
+	tokensLen = 0;
+}
@@ -16,9 +16,17 @@
 
 #include <ctype.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 typedef unsigned char byte;
@@ -37,86 +45,588 @@ static struct {
 	bool ascii;
 	bool offset;
 	bool skip;
-} options = { 16, 8, 0, true, true, false };
+	size_t start;
+	size_t length;
+} options = { 16, 8, 0, true, true, false, 0, SIZE_MAX };
 
-static void dump(FILE *file) {
-	bool skip = false;
+enum { BlockSize = 128 * 1024 };
+
+static char hex[256][2];
+static char print[256];
+
+// Rows are formatted into a template whose column positions are fixed, so
+// bytes can be stored without checking for groups.
+static struct {
+	size_t *hex;
+	size_t *ascii;
+	size_t hexLen;
+	size_t len;
+	char *blank;
+} layout;
+
+static void prepare(void) {
+	for (int i = 0; i < 256; ++i) {
+		hex[i][0] = "0123456789ABCDEF"[i >> 4];
+		hex[i][1] = "0123456789ABCDEF"[i & 0xF];
+		print[i] = (isprint(i) ? i : '.');
+	}
+
+	layout.hex = calloc(options.cols, sizeof(*layout.hex));
+	layout.ascii = calloc(options.cols, sizeof(*layout.ascii));
+	if (!layout.hex || !layout.ascii) err(1, "calloc");
+	size_t pos = 0;
+	for (size_t i = 0; i < options.cols; ++i) {
+		if (options.group && i && !(i % options.group)) pos++;
+		layout.hex[i] = pos;
+		pos += 3;
+	}
+	layout.hexLen = pos;
+	if (options.ascii) {
+		pos++;
+		for (size_t i = 0; i < options.cols; ++i) {
+			if (options.group && i && !(i % options.group)) pos++;
+			layout.ascii[i] = pos++;
+		}
+	}
+	layout.len = pos;
+	layout.blank = malloc(layout.len);
+	if (!layout.blank) err(1, "malloc");
+	memset(layout.blank, ' ', layout.len);
+}
+
+// Maximum length of a formatted row, including an offset and a blank line.
+static size_t rowMax(void) {
+	return 2 * sizeof(size_t) + 3 + layout.len + 2;
+}
+
+// Formats the hex and ASCII columns, padded with spaces to layout.len, and
+// returns their length without trailing ASCII padding.
+static size_t columns(char *ptr, const byte *buf, size_t size) {
+	memcpy(ptr, layout.blank, layout.len);
+	for (size_t i = 0; i < size; ++i) {
+		memcpy(&ptr[layout.hex[i]], hex[buf[i]], 2);
+	}
+	if (!options.ascii || !size) return layout.len;
+	for (size_t i = 0; i < size; ++i) {
+		ptr[layout.ascii[i]] = print[buf[i]];
+	}
+	return layout.ascii[size - 1] + 1;
+}
+
+static size_t address(char *out, size_t offset) {
+	size_t digits = 8;
+	while (digits < 2 * sizeof(offset) && offset >> (4 * digits)) digits++;
+	for (size_t i = 0; i < digits; ++i) {
+		out[digits - 1 - i] = "0123456789ABCDEF"[offset >> (4 * i) & 0xF];
+	}
+	memcpy(&out[digits], ":  ", 3);
+	return digits + 3;
+}
+
+// Formats a line of only an offset, marking the start of a skipped run
+// which begins a dump of a range, or the end of one which ends a dump.
+static size_t mark(char *out, size_t offset) {
+	if (!options.offset) return 0;
+	size_t len = address(out, offset);
+	out[len - 2] = '\n';
+	return len - 1;
+}
+
+static size_t row(char *out, size_t offset, const byte *buf, size_t size) {
+	char *ptr = out;
+	if (options.offset) ptr += address(ptr, offset);
+	ptr += columns(ptr, buf, size);
+	*ptr++ = '\n';
+	return ptr - out;
+}
+
+static void output(const char *ptr, size_t len) {
+	while (len) {
+		ssize_t n = write(STDOUT_FILENO, ptr, len);
+		if (n < 0) err(1, "write");
+		ptr += n;
+		len -= n;
+	}
+}
+
+// Fills buf unless at end of file, so only the last row can be short.
+static size_t input(int fd, byte *buf, size_t cap, const char *path) {
+	size_t len = 0;
+	while (len < cap) {
+		ssize_t n = read(fd, &buf[len], cap - len);
+		if (n < 0) err(1, "%s", (path ? path : "stdin"));
+		if (!n) break;
+		len += n;
+	}
+	return len;
+}
+
+// Formats the rows of buf into out, which must have room for rowMax() per
+// row, and returns the length of output.
+static size_t rows(
+	char *out, size_t offset, const byte *buf, size_t len, bool *skip
+) {
+	size_t outLen = 0;
+	for (size_t i = 0; i < len; i += options.cols, offset += options.cols) {
+		const byte *ptr = &buf[i];
+		size_t size = len - i;
+		if (size > options.cols) size = options.cols;
 
-	byte buf[options.cols];
-	size_t offset = 0;
-	for (
-		size_t size;
-		(size = fread(buf, 1, sizeof(buf), file));
-		offset += size
-	) {
 		if (options.skip) {
-			if (zero(buf, size)) {
-				if (!skip) printf("*\n");
-				skip = true;
+			if (zero(ptr, size)) {
+				if (!*skip && offset && offset == options.start) {
+					outLen += mark(&out[outLen], offset);
+				}
+				if (!*skip) {
+					memcpy(&out[outLen], "*\n", 2);
+					outLen += 2;
+				}
+				*skip = true;
 				continue;
 			} else {
-				skip = false;
+				*skip = false;
 			}
 		}
 
 		if (options.blank) {
 			if (offset && offset % options.blank == 0) {
-				printf("\n");
+				out[outLen++] = '\n';
+			}
+		}
+
+		outLen += row(&out[outLen], offset, ptr, size);
+	}
+	return outLen;
+}
+
+// Ends a skipped run at the end of input with a line of only its offset,
+// so that reversing restores the trailing zeros.
+static void skipEnd(size_t offset) {
+	char out[2 * sizeof(offset) + 3];
+	output(out, mark(out, offset));
+}
+
+static size_t blockRows(void) {
+	return BlockSize / options.cols + 1;
+}
+
+// Seeks to the start offset, or reads up to it from pipes.
+static void seek(int fd, const char *path, byte *buf, size_t cap) {
+	if (0 <= lseek(fd, options.start, SEEK_SET)) return;
+	if (errno != ESPIPE) err(1, "%s", (path ? path : "stdin"));
+	for (size_t len = options.start; len;) {
+		size_t n = input(fd, buf, (len < cap ? len : cap), path);
+		if (!n) break;
+		len -= n;
+	}
+}
+
+static void dump(int fd, const char *path) {
+	bool skip = false;
+
+	size_t cap = blockRows() * options.cols;
+	byte *buf = malloc(cap);
+	if (!buf) err(1, "malloc");
+	char *out = malloc(blockRows() * rowMax());
+	if (!out) err(1, "malloc");
+
+	if (options.start) seek(fd, path, buf, cap);
+	size_t offset = options.start;
+	size_t remain = options.length;
+	for (
+		size_t block;
+		(block = input(fd, buf, (remain < cap ? remain : cap), path));
+		offset += block, remain -= block
+	) {
+		output(out, rows(out, offset, buf, block, &skip));
+	}
+	if (skip) skipEnd(offset);
+	free(out);
+	free(buf);
+}
+
+// Regular files and block devices can be mapped and dumped in chunks by
+// parallel threads. Each chunk is dumped as if not skipping at its start,
+// so a leading * is dropped when the previous chunk ended skipping. The
+// threads dump one chunk each per round, between barriers.
+
+struct Chunk {
+	pthread_t thread;
+	const byte *buf;
+	size_t offset;
+	size_t len;
+	char *out;
+	size_t outLen;
+	bool skip;
+};
+
+static struct {
+	pthread_barrier_t start;
+	pthread_barrier_t end;
+	bool done;
+} rounds;
+
+static void *dumpWorker(void *arg) {
+	struct Chunk *chunk = arg;
+	for (;;) {
+		pthread_barrier_wait(&rounds.start);
+		if (rounds.done) return NULL;
+		chunk->skip = false;
+		chunk->outLen = rows(
+			chunk->out, chunk->offset, chunk->buf, chunk->len, &chunk->skip
+		);
+		pthread_barrier_wait(&rounds.end);
+	}
+}
+
+static void dumpParallel(int fd, const char *path, size_t jobs) {
+	struct stat st;
+	int error = fstat(fd, &st);
+	if (error) err(1, "%s", path);
+	size_t size;
+	if (S_ISREG(st.st_mode)) {
+		size = st.st_size;
+	} else if (S_ISBLK(st.st_mode)) {
+		off_t end = lseek(fd, 0, SEEK_END);
+		if (end < 0) err(1, "%s", path);
+		size = end;
+	} else {
+		dump(fd, path);
+		return;
+	}
+	if (options.start < size && options.length < size - options.start) {
+		size = options.start + options.length;
+	}
+	if (options.start >= size) return;
+
+	size_t chunkLen = blockRows() * options.cols;
+	size_t chunksLen = (size - options.start - 1) / chunkLen + 1;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1) cpus = 1;
+	if (jobs > (size_t)cpus) jobs = cpus;
+	if (jobs > chunksLen) jobs = chunksLen;
+	if (jobs < 2) {
+		dump(fd, path);
+		return;
+	}
+
+	size_t base = options.start - options.start % sysconf(_SC_PAGESIZE);
+	const byte *map = mmap(NULL, size - base, PROT_READ, MAP_SHARED, fd, base);
+	if (map == MAP_FAILED) err(1, "%s", path);
+
+	error = pthread_barrier_init(&rounds.start, NULL, jobs + 1)
+		|| pthread_barrier_init(&rounds.end, NULL, jobs + 1);
+	if (error) errx(1, "pthread_barrier_init");
+	struct Chunk *chunks = calloc(jobs, sizeof(*chunks));
+	if (!chunks) err(1, "calloc");
+	for (size_t i = 0; i < jobs; ++i) {
+		chunks[i].out = malloc(blockRows() * rowMax());
+		if (!chunks[i].out) err(1, "malloc");
+		error = pthread_create(
+			&chunks[i].thread, NULL, dumpWorker, &chunks[i]
+		);
+		if (error) errx(1, "pthread_create: %s", strerror(error));
+	}
+
+	bool skip = false;
+	for (size_t offset = options.start; offset < size;) {
+		for (size_t i = 0; i < jobs; ++i, offset += chunkLen) {
+			size_t len = (offset < size ? size - offset : 0);
+			chunks[i].buf = (len ? &map[offset - base] : map);
+			chunks[i].offset = offset;
+			chunks[i].len = (len > chunkLen ? chunkLen : len);
+		}
+		pthread_barrier_wait(&rounds.start);
+		pthread_barrier_wait(&rounds.end);
+		for (size_t i = 0; i < jobs && chunks[i].len; ++i) {
+			const char *out = chunks[i].out;
+			size_t len = chunks[i].outLen;
+			size_t first = chunks[i].len;
+			if (first > options.cols) first = options.cols;
+			if (skip && options.skip && zero(chunks[i].buf, first)) {
+				out += 2;
+				len -= 2;
 			}
+			output(out, len);
+			skip = chunks[i].skip;
 		}
+	}
+	if (skip) skipEnd(size);
+
+	rounds.done = true;
+	pthread_barrier_wait(&rounds.start);
+	for (size_t i = 0; i < jobs; ++i) {
+		error = pthread_join(chunks[i].thread, NULL);
+		if (error) errx(1, "pthread_join: %s", strerror(error));
+		free(chunks[i].out);
+	}
+	free(chunks);
+	pthread_barrier_destroy(&rounds.start);
+	pthread_barrier_destroy(&rounds.end);
+	munmap((void *)map, size - base);
+}
+
+// Differing rows are formatted side by side, and identical runs are
+// collapsed as if skipping zeros.
+static int diff(int fd1, int fd2, const char *path1, const char *path2) {
+	size_t cap = blockRows() * options.cols;
+	byte *buf1 = malloc(cap);
+	byte *buf2 = malloc(cap);
+	if (!buf1 || !buf2) err(1, "malloc");
+	char *out = malloc(blockRows() * (rowMax() + layout.len + 3));
+	if (!out) err(1, "malloc");
 
-		if (options.offset) {
-			printf("%08zX:  ", offset);
+	if (options.start) {
+		seek(fd1, path1, buf1, cap);
+		seek(fd2, path2, buf2, cap);
+	}
+
+	bool skip = false;
+	size_t diffRows = 0, diffBytes = 0;
+	size_t offset = options.start;
+	size_t remain = options.length;
+	while (remain) {
+		size_t max = (remain < cap ? remain : cap);
+		size_t len1 = input(fd1, buf1, max, path1);
+		size_t len2 = input(fd2, buf2, max, path2);
+		if (!len1 && !len2) break;
+		size_t block = (len1 > len2 ? len1 : len2);
+
+		if (len1 == len2 && !memcmp(buf1, buf2, block)) {
+			if (!skip) output("*\n", 2);
+			skip = true;
+			offset += block;
+			remain -= block;
+			continue;
 		}
 
-		for (size_t i = 0; i < sizeof(buf); ++i) {
-			if (options.group) {
-				if (i && !(i % options.group)) {
-					printf(" ");
+		size_t len = 0;
+		for (size_t i = 0; i < block; i += options.cols) {
+			size_t size1 = (i < len1 ? len1 - i : 0);
+			size_t size2 = (i < len2 ? len2 - i : 0);
+			if (size1 > options.cols) size1 = options.cols;
+			if (size2 > options.cols) size2 = options.cols;
+			if (size1 == size2 && !memcmp(&buf1[i], &buf2[i], size1)) {
+				if (!skip) {
+					memcpy(&out[len], "*\n", 2);
+					len += 2;
 				}
+				skip = true;
+				continue;
 			}
-			if (i < size) {
-				printf("%02hhX ", buf[i]);
-			} else {
-				printf("   ");
+			skip = false;
+
+			diffRows++;
+			for (size_t j = 0; j < options.cols; ++j) {
+				if (j >= size1 && j >= size2) break;
+				if (j >= size1 || j >= size2 || buf1[i+j] != buf2[i+j]) {
+					diffBytes++;
+				}
 			}
+			char *ptr = &out[len];
+			if (options.offset) ptr += address(ptr, offset + i);
+			columns(ptr, &buf1[i], size1);
+			ptr += layout.len;
+			memcpy(ptr, " | ", 3);
+			ptr += 3;
+			ptr += columns(ptr, &buf2[i], size2);
+			*ptr++ = '\n';
+			len = ptr - out;
 		}
+		output(out, len);
+		offset += block;
+		remain -= block;
+	}
+	free(out);
+	free(buf2);
+	free(buf1);
 
-		if (options.ascii) {
-			printf(" ");
-			for (size_t i = 0; i < size; ++i) {
-				if (options.group) {
-					if (i && !(i % options.group)) {
-						printf(" ");
-					}
-				}
-				printf("%c", isprint(buf[i]) ? buf[i] : '.');
+	printf("%zu bytes differ in %zu rows\n", diffBytes, diffRows);
+	return (diffBytes ? 1 : 0);
+}
+
+static byte unhex[256];
+
+static struct {
+	byte *buf;
+	size_t len;
+	size_t pos;
+	byte *row;
+	bool based;
+	size_t base;
+} undumped;
+
+static void put(byte b) {
+	if (undumped.len == BlockSize) {
+		output((char *)undumped.buf, undumped.len);
+		undumped.len = 0;
+	}
+	undumped.buf[undumped.len++] = b;
+	undumped.pos++;
+}
+
+static void zeros(size_t len) {
+	while (len--) put(0);
+}
+
+static void token(byte *row, size_t *n, byte b) {
+	if (!row) {
+		put(b);
+	} else if (*n < options.cols) {
+		row[*n] = b;
+	} else {
+		errx(1, "row wider than %zu columns", options.cols);
+	}
+	++*n;
+}
+
+// Parses hex tokens into row, which has room for a row of columns, or
+// outputs them if row is NULL, and returns the number of bytes parsed.
+static size_t tokens(byte *row, const char *ptr, const char *end) {
+	size_t n = 0;
+	while (ptr < end) {
+		if (*ptr == ' ' || *ptr == '\t' || *ptr == '\r') {
+			ptr++;
+			continue;
+		}
+		const char *tok = ptr;
+		while (ptr < end && unhex[(byte)*ptr] < 16) ptr++;
+		size_t len = ptr - tok;
+		if (!len || (ptr < end && !isspace((byte)*ptr))) {
+			errx(1, "invalid input");
+		}
+		if (len == 1) {
+			token(row, &n, unhex[(byte)*tok]);
+			continue;
+		}
+		if (len % 2) errx(1, "invalid input");
+		for (size_t i = 0; i < len; i += 2) {
+			token(row, &n, unhex[(byte)tok[i]] << 4 | unhex[(byte)tok[i+1]]);
+		}
+	}
+	return n;
+}
+
+// Rows with an offset must fit the layout, otherwise the row was dumped
+// with other options. The ASCII column is only measured, not compared, so
+// it may be edited freely.
+static void unrow(const char *ptr, const char *end) {
+	if (end > ptr && end[-1] == '\r') end--;
+	const char *hexEnd = &ptr[layout.hexLen];
+	if (hexEnd > end) hexEnd = end;
+	size_t n = tokens(undumped.row, ptr, hexEnd);
+	if (!options.ascii || !n) {
+		for (const char *rest = hexEnd; rest < end; ++rest) {
+			if (!isspace((byte)*rest)) {
+				errx(1, "row wider than %zu columns", options.cols);
 			}
 		}
+	} else {
+		if (end - ptr != (ptrdiff_t)(layout.ascii[n - 1] + 1)) {
+			errx(1, "row wider than %zu columns", options.cols);
+		}
+	}
+	for (size_t i = 0; i < n; ++i) {
+		put(undumped.row[i]);
+	}
+}
 
-		printf("\n");
+// Lines starting with an offset are parsed as output of dump, so their hex
+// is only read from its columns and skipped runs of zeros are restored.
+// Other lines may only contain hex.
+static void unline(const char *ptr, const char *end, bool *skip) {
+	if (end - ptr == 1 && *ptr == '*') {
+		// A dump from the start of a file may begin skipping.
+		undumped.based = true;
+		*skip = true;
+		return;
+	}
+
+	const char *digits = ptr;
+	while (digits < end && unhex[(byte)*digits] < 16) digits++;
+	if (digits > ptr && digits < end && *digits == ':') {
+		size_t offset = 0;
+		for (; ptr < digits; ++ptr) {
+			offset = offset << 4 | unhex[(byte)*ptr];
+		}
+		// Dumps of a range start at an offset other than zero.
+		if (!undumped.based) {
+			undumped.based = true;
+			undumped.base = offset;
+		}
+		size_t pos = undumped.base + undumped.pos;
+		if (*skip && offset > pos) zeros(offset - pos);
+		*skip = false;
+		ptr++;
+		if (end - ptr < 2) return;
+		unrow(&ptr[2], end);
+		return;
 	}
+	*skip = false;
+	tokens(NULL, ptr, end);
 }
 
-static void undump(FILE *file) {
-	byte c;
-	int match;
-	while (0 < (match = fscanf(file, " %hhx", &c))) {
-		printf("%c", c);
+static void undump(int fd, const char *path) {
+	memset(unhex, 0xFF, sizeof(unhex));
+	for (int i = 0; i < 16; ++i) {
+		unhex[(byte)"0123456789ABCDEF"[i]] = i;
+		unhex[(byte)"0123456789abcdef"[i]] = i;
 	}
-	if (!match) errx(1, "invalid input");
+	undumped.buf = malloc(BlockSize);
+	undumped.row = malloc(options.cols);
+	if (!undumped.buf || !undumped.row) err(1, "malloc");
+
+	size_t cap = BlockSize;
+	char *buf = malloc(cap);
+	if (!buf) err(1, "malloc");
+	size_t len = 0;
+
+	bool skip = false;
+	for (bool eof = false; !eof;) {
+		if (len == cap) {
+			cap *= 2;
+			buf = realloc(buf, cap);
+			if (!buf) err(1, "realloc");
+		}
+		ssize_t n = read(fd, &buf[len], cap - len);
+		if (n < 0) err(1, "%s", (path ? path : "stdin"));
+		if (!n) eof = true;
+		len += n;
+
+		char *line = buf;
+		char *end = &buf[len];
+		for (char *nl; line < end; line = &nl[1]) {
+			nl = memchr(line, '\n', end - line);
+			if (!nl && !eof) break;
+			if (!nl) nl = end;
+			unline(line, nl, &skip);
+		}
+		if (line > end) line = end;
+		len = end - line;
+		memmove(buf, line, len);
+	}
+	output((char *)undumped.buf, undumped.len);
+	free(undumped.row);
+	free(undumped.buf);
+	free(buf);
 }
 
 int main(int argc, char *argv[]) {
+	bool compare = false;
 	bool reverse = false;
+	size_t jobs = 1;
 	const char *path = NULL;
 
 	int opt;
-	while (0 < (opt = getopt(argc, argv, "ac:g:p:rsz"))) {
+	while (0 < (opt = getopt(argc, argv, "ab:c:dg:j:n:p:rsz"))) {
 		switch (opt) {
 			break; case 'a': options.ascii ^= true;
+			break; case 'b': options.start = strtoull(optarg, NULL, 0);
 			break; case 'c': options.cols = strtoul(optarg, NULL, 0);
+			break; case 'd': compare = true;
 			break; case 'g': options.group = strtoul(optarg, NULL, 0);
+			break; case 'j': jobs = strtoul(optarg, NULL, 0);
+			break; case 'n': options.length = strtoull(optarg, NULL, 0);
 			break; case 'p': options.blank = strtoul(optarg, NULL, 0);
 			break; case 'r': reverse = true;
 			break; case 's': options.offset ^= true;
@@ -125,17 +635,26 @@ int main(int argc, char *argv[]) {
 		}
 	}
 	if (argc > optind) path = argv[optind];
-	if (!options.cols) return 1;
+	if (!options.cols || !jobs) return 1;
 
-	FILE *file = path ? fopen(path, "r") : stdin;
-	if (!file) err(1, "%s", path);
+	int fd = (path ? open(path, O_RDONLY) : STDIN_FILENO);
+	if (fd < 0) err(1, "%s", path);
 
+	prepare();
+	if (compare) {
+		if (argc - optind < 2) return 1;
+		const char *path2 = argv[optind + 1];
+		int fd2 = open(path2, O_RDONLY);
+		if (fd2 < 0) err(1, "%s", path2);
+		return diff(fd, fd2, path, path2);
+	}
 	if (reverse) {
-		undump(file);
+		undump(fd, path);
+	} else if (jobs > 1) {
+		dumpParallel(fd, path, jobs);
 	} else {
-		dump(file);
+		dump(fd, path);
 	}
-	if (ferror(file)) err(1, "%s", path);
 
 	return 0;
 }
@@ -1,30 +1,243 @@
+#include <dirent.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <fnmatch.h>
 #include <limits.h>
+#include <sha2.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #define Q(...) #__VA_ARGS__
 
+// Rendered output is cached in files named by a hash of the filter, the
+// renderer and its arguments, the file name and the input. Files are
+// touched on each hit and the least recently used are evicted once the
+// cache grows past CacheMax, down to CacheLow.
+#define CACHE_DIR "/cache/filter"
+enum {
+	CacheMax = 256 * 1024 * 1024,
+	CacheLow = CacheMax / 4 * 3,
+	TempAge = 60 * 60,
+};
+
+static void copy(int dst, int src) {
+	char buf[4096];
+	for (ssize_t len; 0 < (len = read(src, buf, sizeof(buf)));) {
+		if (write(dst, buf, len) < 0) err(1, "write");
+	}
+}
+
+static int render(char *const cmd[], const char *buf, size_t len, int out) {
+	int rw[2];
+	if (pipe(rw) < 0) err(1, "pipe");
+	pid_t pid = fork();
+	if (pid < 0) err(1, "fork");
+	if (!pid) {
+		dup2(rw[0], STDIN_FILENO);
+		dup2(out, STDOUT_FILENO);
+		close(rw[0]);
+		close(rw[1]);
+		execvp(cmd[0], cmd);
+		err(127, "%s", cmd[0]);
+	}
+	close(rw[0]);
+	signal(SIGPIPE, SIG_IGN);
+	while (len) {
+		ssize_t n = write(rw[1], buf, len);
+		if (n < 0 && errno == EPIPE) break;
+		if (n < 0) err(1, "write");
+		buf += n;
+		len -= n;
+	}
+	close(rw[1]);
+	int status;
+	if (waitpid(pid, &status, 0) < 0) err(1, "waitpid");
+	return (WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+}
+
+static struct Entry {
+	char name[NAME_MAX + 1];
+	time_t mtime;
+	off_t size;
+} *entries;
+
+static int compar(const void *_a, const void *_b) {
+	const struct Entry *a = _a, *b = _b;
+	return (a->mtime > b->mtime) - (a->mtime < b->mtime);
+}
+
+// Returns the size of the cache after eviction. Temporary files left by
+// interrupted renders are removed once they are old enough.
+static off_t evict(int dir) {
+	DIR *list = fdopendir(dup(dir));
+	if (!list) return 0;
+	time_t now = time(NULL);
+	size_t len = 0, cap = 0;
+	off_t total = 0;
+	for (struct dirent *ent; (ent = readdir(list));) {
+		struct stat st;
+		if (ent->d_name[0] == '.') {
+			if (strncmp(ent->d_name, ".tmp.", 5)) continue;
+			if (fstatat(dir, ent->d_name, &st, 0) < 0) continue;
+			if (now - st.st_mtime > TempAge) unlinkat(dir, ent->d_name, 0);
+			continue;
+		}
+		if (fstatat(dir, ent->d_name, &st, 0) < 0) continue;
+		if (len == cap) {
+			cap = (cap ? cap * 2 : 256);
+			entries = realloc(entries, sizeof(*entries) * cap);
+			if (!entries) err(1, "realloc");
+		}
+		snprintf(
+			entries[len].name, sizeof(entries[len].name), "%s", ent->d_name
+		);
+		entries[len].mtime = st.st_mtime;
+		entries[len].size = st.st_size;
+		total += st.st_size;
+		len++;
+	}
+	closedir(list);
+	if (total <= CacheMax) return total;
+	qsort(entries, len, sizeof(*entries), compar);
+	for (size_t i = 0; i < len && total > CacheLow; ++i) {
+		if (unlinkat(dir, entries[i].name, 0) == 0) total -= entries[i].size;
+	}
+	return total;
+}
+
+// The size of the cache and its hit and miss counts are kept in .stats
+// as fixed-width fields, rewritten in place under a lock. The cache is
+// only scanned for eviction once its size passes CacheMax.
+static void account(int dir, off_t size, uintmax_t hits, uintmax_t misses) {
+	int fd = openat(dir, ".stats", O_RDWR | O_CREAT, 0644);
+	if (fd < 0) return;
+	if (flock(fd, LOCK_EX) < 0) goto done;
+	char buf[64];
+	ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len < 0) goto done;
+	buf[len] = '\0';
+	intmax_t total = 0;
+	uintmax_t hit = 0, miss = 0;
+	sscanf(buf, "%jd %ju %ju", &total, &hit, &miss);
+	total += size;
+	if (total > CacheMax) total = evict(dir);
+	len = snprintf(
+		buf, sizeof(buf), "%20jd %20ju %20ju\n",
+		total, hit + hits, miss + misses
+	);
+	if (pwrite(fd, buf, len, 0) < 0) warn(".stats");
+done:
+	close(fd);
+}
+
+// The renderer is identified by its executable, so that upgrading it
+// changes the keys of its output.
+static void version(SHA2_CTX *ctx, const char *cmd) {
+	const char *path = getenv("PATH");
+	if (!path) path = "/bin:/usr/bin";
+	for (const char *dir = path; *dir; dir += strspn(dir, ":")) {
+		size_t len = strcspn(dir, ":");
+		char exe[PATH_MAX];
+		snprintf(exe, sizeof(exe), "%.*s/%s", (int)len, dir, cmd);
+		dir += len;
+		struct stat st;
+		if (stat(exe, &st) < 0 || !S_ISREG(st.st_mode)) continue;
+		char buf[128];
+		int n = snprintf(
+			buf, sizeof(buf), "%ju %ju %jd %jd.%09ld",
+			(uintmax_t)st.st_dev, (uintmax_t)st.st_ino, (intmax_t)st.st_size,
+			(intmax_t)st.st_mtim.tv_sec, st.st_mtim.tv_nsec
+		);
+		SHA256Update(ctx, (const uint8_t *)buf, n + 1);
+		return;
+	}
+}
+
+static int cache(const char *filter, const char *name, char *const cmd[]) {
+	char *buf = NULL;
+	size_t len = 0, cap = 0;
+	for (ssize_t n;; len += n) {
+		if (len == cap) {
+			cap = (cap ? cap * 2 : 4096);
+			buf = realloc(buf, cap);
+			if (!buf) err(1, "realloc");
+		}
+		n = read(STDIN_FILENO, &buf[len], cap - len);
+		if (n < 0) err(1, "read");
+		if (!n) break;
+	}
+
+	SHA2_CTX ctx;
+	char key[SHA256_DIGEST_STRING_LENGTH];
+	SHA256Init(&ctx);
+	SHA256Update(&ctx, (const uint8_t *)filter, strlen(filter) + 1);
+	version(&ctx, cmd[0]);
+	for (char *const *arg = cmd; *arg; ++arg) {
+		SHA256Update(&ctx, (const uint8_t *)*arg, strlen(*arg) + 1);
+	}
+	SHA256Update(&ctx, (const uint8_t *)name, strlen(name) + 1);
+	SHA256Update(&ctx, (const uint8_t *)buf, len);
+	SHA256End(&ctx, key);
+
+	int dir = open(CACHE_DIR, O_RDONLY | O_DIRECTORY);
+	if (dir < 0) return render(cmd, buf, len, STDOUT_FILENO);
+
+	int fd = openat(dir, key, O_RDONLY);
+	if (fd >= 0) {
+		account(dir, 0, 1, 0);
+		futimens(fd, NULL);
+		copy(STDOUT_FILENO, fd);
+		return 0;
+	}
+	account(dir, 0, 0, 1);
+
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", CACHE_DIR, key);
+	snprintf(tmp, sizeof(tmp), "%s/.tmp.%s.XXXXXXXXXX", CACHE_DIR, key);
+	fd = mkstemp(tmp);
+	if (fd < 0) return render(cmd, buf, len, STDOUT_FILENO);
+
+	int status = render(cmd, buf, len, fd);
+	off_t size = lseek(fd, 0, SEEK_CUR);
+	if (lseek(fd, 0, SEEK_SET) < 0) err(1, "%s", tmp);
+	copy(STDOUT_FILENO, fd);
+	if (status || rename(tmp, path) < 0) {
+		unlink(tmp);
+	} else {
+		account(dir, size, 0, 0);
+	}
+	return status;
+}
+
 #define MANDOC_OPTIONS "fragment,man=%N.%S,includes=../tree/%I"
 
 static int about(int argc, char *argv[]) {
 	if (argc < 2) return 1;
 	if (!fnmatch("README.[1-9]", argv[1], 0)) {
-		execlp("mandoc", "mandoc", "-T", "html", "-O", MANDOC_OPTIONS, NULL);
-		err(127, "mandoc");
+		char *cmd[] = {
+			"mandoc", "-T", "html", "-O", MANDOC_OPTIONS, NULL,
+		};
+		return cache("about", argv[1], cmd);
 	} else if (!fnmatch("*.[1-9]", argv[1], 0)) {
-		execlp(
-			"mandoc", "mandoc", "-T", "html", "-O", "toc," MANDOC_OPTIONS, NULL
-		);
-		err(127, "mandoc");
+		char *cmd[] = {
+			"mandoc", "-T", "html", "-O", "toc," MANDOC_OPTIONS, NULL,
+		};
+		return cache("about", argv[1], cmd);
 	} else {
-		execlp("hilex", "hilex", "-l", "text", "-f", "html", "-o", "pre", NULL);
-		err(127, "hilex");
+		char *cmd[] = {
+			"hilex", "-l", "text", "-f", "html", "-o", "pre", NULL,
+		};
+		return cache("about", argv[1], cmd);
 	}
 }
 
@@ -45,105 +258,21 @@ static int owner(void) {
 	return 0;
 }
 
-#define CTAGS_PATTERN "*.[chlmy]"
-#define TEMPLATE "/tmp/filter.XXXXXXXXXX"
-
-static char tmp[PATH_MAX];
-static char tags[] = TEMPLATE;
-static void cleanup(void) {
-	unlink(tmp);
-	unlink(tags);
-}
-
 static int source(int argc, char *argv[]) {
 	if (argc < 2) return 1;
-	if (
-		strcmp("Makefile", argv[1]) &&
-		strcmp(".profile", argv[1]) &&
-		strcmp(".shrc", argv[1]) &&
-		fnmatch(CTAGS_PATTERN, argv[1], 0) &&
-		fnmatch("*.mk", argv[1], 0) &&
-		fnmatch("*.[1-9]", argv[1], 0) &&
-		fnmatch("*.sh", argv[1], 0)
-	) {
-		execlp("hilex", "hilex", "-t", "-n", argv[1], "-f", "html", NULL);
-		err(127, "hilex");
-	}
-
-	const char *ext = strrchr(argv[1], '.');
-	if (!strcmp(argv[1], ".profile") || !strcmp(argv[1], ".shrc")) {
-		ext = ".sh";
-	} else if (!strcmp(argv[1], "Makefile")) {
-		ext = ".mk";
-	} else if (!ext) {
-		ext = "";
-	}
-
-	snprintf(tmp, sizeof(tmp), TEMPLATE "%s", ext);
-	int fd = mkstemps(tmp, strlen(ext));
-	if (fd < 0) err(1, "%s", tmp);
-	atexit(cleanup);
-
-	char buf[4096];
-	for (ssize_t len; 0 < (len = read(STDIN_FILENO, buf, sizeof(buf)));) {
-		if (write(fd, buf, len) < 0) err(1, "%s", tmp);
-	}
-	if (close(fd) < 0) err(1, "%s", tmp);
-
-	fd = mkstemp(tags);
-	if (fd < 0) err(1, "%s", tags);
-	close(fd);
-	pid_t pid = fork();
-	if (pid < 0) err(1, "fork");
-	if (!pid) {
-		if (!fnmatch(CTAGS_PATTERN, argv[1], 0)) {
-			execlp("ctags", "ctags", "-w", "-f", tags, tmp, NULL);
-			warn("ctags");
-		} else {
-			execlp("mtags", "mtags", "-f", tags, tmp, NULL);
-			warn("mtags");
-		}
-		_exit(127);
-	}
-	int status;
-	if (wait(&status) < 0) err(1, "wait");
-
-	int rw[2];
-	if (pipe(rw) < 0) err(1, "pipe");
-	pid = fork();
-	if (pid < 0) err(1, "fork");
-	if (!pid) {
-		dup2(rw[1], STDOUT_FILENO);
-		close(rw[0]);
-		close(rw[1]);
-		execlp("hilex", "hilex", "-f", "html", tmp, NULL);
-		warn("hilex");
-		_exit(127);
-	}
-	pid = fork();
-	if (pid < 0) err(1, "fork");
-	if (!pid) {
-		dup2(rw[0], STDIN_FILENO);
-		close(rw[0]);
-		close(rw[1]);
-		execlp("htagml", "htagml", "-im", "-f", tags, tmp, NULL);
-		warn("htagml");
-		_exit(127);
-	}
-	close(rw[0]);
-	close(rw[1]);
-
-	if (wait(&status) < 0) err(1, "wait");
-	if (wait(&status) < 0) err(1, "wait");
-	return status;
+	char *cmd[] = {
+		"hilex", "-t", "-n", argv[1], "-f", "html", "-o", "tags", NULL,
+	};
+	return cache("source", argv[1], cmd);
 }
 
 int main(int argc, char *argv[]) {
 #ifdef __OpenBSD__
 	int error;
 	switch (getprogname()[0]) {
-		break; case 'a': error = pledge("stdio exec", NULL);
-		break; case 's': error = pledge("stdio tmppath proc exec", NULL);
+		break; case 'a': case 's': error = pledge(
+			"stdio rpath wpath cpath fattr flock proc exec", NULL
+		);
 		break; default:  error = pledge("stdio", NULL);
 	}
 	if (error) err(1, "pledge");